@@ -0,0 +1,179 @@
+/**
+ * affinity.c
+ *
+ * Chooses which CPU each worker thread is pinned to. CPUs are read from the
+ * process's allowed set (so taskset and cgroup limits are honored) and, for
+ * the "cores" policy, ordered using the topology in sysfs so that every
+ * physical core gets one worker before any SMT sibling gets a second.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum affinity {
+    AFFINITY_NONE,    /* let the scheduler place threads */
+    AFFINITY_LINEAR,  /* allowed CPUs in numeric order */
+    AFFINITY_CORES,   /* one per physical core first, then SMT siblings */
+    AFFINITY_LIST     /* CPUs given on the command line */
+};
+
+struct cpu_topology {
+    int cpu;
+    int package;
+    int core;
+    int sibling;  /* rank among the CPUs sharing this core */
+};
+
+int cpu_order(enum affinity policy, int cpus[], int max_cpus);
+int parse_cpu_list(const char *list, int cpus[], int max_cpus);
+int unavailable_cpu(const int cpus[], int count);
+
+/* Function: read_topology_id
+ * --------------------------
+ * Reads one integer from /sys/devices/system/cpu/cpuN/topology/name.
+ *
+ * returns: the value, or -1 if it could not be read
+ */
+static int read_topology_id(int cpu, const char *name) {
+    char path[128];
+    snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    int id = -1;
+    if (fscanf(file, "%d", &id) != 1)
+        id = -1;
+    fclose(file);
+    return id;
+}
+
+static int compare_topology(const void *a, const void *b) {
+    const struct cpu_topology *x = a;
+    const struct cpu_topology *y = b;
+    if (x->sibling != y->sibling)
+        return x->sibling - y->sibling;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/* Function: cpu_order
+ * -------------------
+ * Lists the CPUs this process may run on, in the order workers should be
+ * pinned to them.
+ *
+ * policy: AFFINITY_LINEAR or AFFINITY_CORES
+ * cpus: receives the CPU numbers
+ * max_cpus: size of cpus
+ *
+ * returns: number of CPUs written, or -1 if the allowed set is unknown
+ */
+int cpu_order(enum affinity policy, int cpus[], int max_cpus) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return -1;
+
+    struct cpu_topology *topology = calloc(CPU_SETSIZE, sizeof(*topology));
+    int count = 0;
+    int cpu, i;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        struct cpu_topology *t = &topology[count++];
+        t->cpu = cpu;
+        t->package = read_topology_id(cpu, "physical_package_id");
+        t->core = read_topology_id(cpu, "core_id");
+
+        /* Without topology information treat every CPU as its own core */
+        if (t->core < 0)
+            t->core = cpu;
+
+        t->sibling = 0;
+        for (i = 0; i < count - 1; i++) {
+            if (topology[i].package == t->package && topology[i].core == t->core)
+                t->sibling++;
+        }
+    }
+
+    if (policy == AFFINITY_CORES)
+        qsort(topology, count, sizeof(*topology), compare_topology);
+
+    if (count > max_cpus)
+        count = max_cpus;
+    for (i = 0; i < count; i++)
+        cpus[i] = topology[i].cpu;
+
+    free(topology);
+    return count;
+}
+
+/* Function: parse_cpu_list
+ * ------------------------
+ * Parses a CPU list such as "0,2,4-7" (the format used by taskset -c and
+ * sysfs).
+ *
+ * returns: number of CPUs written to cpus, or -1 if the list is malformed
+ */
+int parse_cpu_list(const char *list, int cpus[], int max_cpus) {
+    int count = 0;
+    const char *p = list;
+
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return -1;
+            p = end;
+        }
+
+        long cpu;
+        for (cpu = first; cpu <= last && count < max_cpus; cpu++)
+            cpus[count++] = cpu;
+
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+    }
+
+    return count;
+}
+
+/* Function: unavailable_cpu
+ * -------------------------
+ * Checks CPUs against the set this process may run on, the same one
+ * cpu_order() reads.
+ *
+ * returns: the first of cpus the process may not use, or -1 if it may use
+ *          them all (or the allowed set is unknown)
+ */
+int unavailable_cpu(const int cpus[], int count) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return -1;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        if (!CPU_ISSET(cpus[i], &allowed))
+            return cpus[i];
+    }
+    return -1;
+}
@@ -0,0 +1,128 @@
+/**
+ * arena.c
+ *
+ * Memory that lives as long as a worker, carved out of one mapping made up
+ * front so that mining makes no allocator calls once it is going. Each
+ * arena is backed by huge pages when the system has them: reserved
+ * hugetlbfs pages if there are any, otherwise a 2 MB-aligned mapping marked
+ * for transparent huge pages. A worker's buffers then sit under one TLB
+ * entry. Allocation just bumps a pointer; nothing is freed on its own, and
+ * the whole arena is unmapped at once.
+ *
+ * The memory is never written here, so the first thread to touch a page
+ * decides which NUMA node it lands on, as with any fresh mapping.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define ARENA_HUGE_PAGE (2u << 20)
+#define ARENA_ALIGN 64
+
+enum arena_backing {
+    ARENA_HUGETLB,  /* reserved huge pages */
+    ARENA_THP,      /* transparent huge pages, if the kernel finds them */
+    ARENA_PAGES     /* ordinary pages */
+};
+
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+    enum arena_backing backing;
+};
+
+int arena_init(struct arena *arena, size_t size);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_destroy(struct arena *arena);
+const char *arena_backing_name(enum arena_backing backing);
+size_t peak_rss(void);
+
+/* Function: arena_init
+ * --------------------
+ * Maps an arena of at least size bytes, rounded up to whole huge pages.
+ *
+ * returns: 0, or -1 if no memory could be mapped
+ */
+int arena_init(struct arena *arena, size_t size) {
+    size = (size + ARENA_HUGE_PAGE - 1) & ~(size_t) (ARENA_HUGE_PAGE - 1);
+    arena->size = size;
+    arena->used = 0;
+
+    arena->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena->base != MAP_FAILED) {
+        arena->backing = ARENA_HUGETLB;
+        return 0;
+    }
+
+    /* Transparent huge pages only cover aligned 2 MB ranges, so map one
+     * page extra and trim the ends to a boundary */
+    char *mem = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        arena->base = NULL;
+        return -1;
+    }
+    char *base = (char *) (((uintptr_t) mem + ARENA_HUGE_PAGE - 1)
+            & ~(uintptr_t) (ARENA_HUGE_PAGE - 1));
+    if (base > mem)
+        munmap(mem, base - mem);
+    munmap(base + size, mem + ARENA_HUGE_PAGE - base);
+    arena->base = base;
+    arena->backing = madvise(base, size, MADV_HUGEPAGE) == 0 ? ARENA_THP : ARENA_PAGES;
+    return 0;
+}
+
+/* Function: arena_alloc
+ * ---------------------
+ * Takes size bytes from an arena, aligned to a cache line. Not thread-safe:
+ * an arena is filled by one thread at a time.
+ *
+ * returns: zeroed memory, or NULL if the arena is full
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (arena->base == NULL || start + size > arena->size)
+        return NULL;
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+/* Function: arena_destroy
+ * -----------------------
+ * Unmaps an arena and everything allocated from it.
+ */
+void arena_destroy(struct arena *arena) {
+    if (arena->base != NULL)
+        munmap(arena->base, arena->size);
+    arena->base = NULL;
+    arena->size = arena->used = 0;
+}
+
+const char *arena_backing_name(enum arena_backing backing) {
+    switch (backing) {
+    case ARENA_HUGETLB:
+        return "huge pages";
+    case ARENA_THP:
+        return "transparent huge pages";
+    default:
+        return "normal pages";
+    }
+}
+
+/* Function: peak_rss
+ * ------------------
+ * returns: the most memory the process has had resident so far, in bytes
+ */
+size_t peak_rss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (size_t) usage.ru_maxrss * 1024;  /* kilobytes on Linux */
+}
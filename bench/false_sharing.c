@@ -0,0 +1,76 @@
+/**
+ * false_sharing.c
+ *
+ * Shows what false sharing costs the miner's per-thread counters. Each
+ * thread bumps its own counter, once with the counters packed next to each
+ * other (the way the calloc'd thread_info structs used to sit) and once
+ * with every counter on its own cache line (CACHE_ALIGNED in mine.c).
+ *
+ * Compile:  make bench
+ * Run:      ./bench/false_sharing [threads]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+#define INCREMENTS 50000000
+
+struct packed_counter {
+    volatile uint64_t value;
+};
+
+struct padded_counter {
+    volatile uint64_t value;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct packed_counter packed[64];
+struct padded_counter padded[64];
+
+void *bump_packed(void *arg) {
+    volatile uint64_t *counter = &packed[(intptr_t) arg].value;
+    int i;
+    for (i = 0; i < INCREMENTS; i++)
+        (*counter)++;
+    return NULL;
+}
+
+void *bump_padded(void *arg) {
+    volatile uint64_t *counter = &padded[(intptr_t) arg].value;
+    int i;
+    for (i = 0; i < INCREMENTS; i++)
+        (*counter)++;
+    return NULL;
+}
+
+double run(void *(*fn)(void *), int num_threads) {
+    pthread_t threads[64];
+    struct timespec start, end;
+    intptr_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, fn, (void *) i);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return elapsed * 1e9 / INCREMENTS;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = (argc > 1) ? atoi(argv[1]) : 4;
+    if (num_threads < 1 || num_threads > 64) {
+        printf("Usage: %s [threads (1-64)]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d threads, %d increments each\n", num_threads, INCREMENTS);
+    printf("packed counters: %.2f ns/increment\n", run(bump_packed, num_threads));
+    printf("padded counters: %.2f ns/increment\n", run(bump_padded, num_threads));
+    return 0;
+}
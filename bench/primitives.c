@@ -0,0 +1,692 @@
+/**
+ * primitives.c
+ *
+ * Microbenchmarks for the pieces the miner is built from, to go with the
+ * end-to-end numbers from mine --bench. Before anything is timed, every
+ * hash kernel this CPU supports is checked: the reference code against the
+ * FIPS 180 SHA-1 test vectors (and double SHA-256 of the same messages),
+ * and each faster kernel against the reference on random one- and
+ * two-block tails. scan_nonces() is also run with each kernel over nonce
+ * ranges whose ends share trailing digits or bytes, and must find the same
+ * nonces as hashing them one at a time. Any mismatch is reported and
+ * nothing is timed.
+ *
+ * Then it times:
+ *   - one block compression with each SHA-1 kernel, in ns per block (per
+ *     lane for the multi-buffer kernels), and the same for SHA-256d
+ *   - sha1sum() on messages of several lengths
+ *   - writing a nonce as decimal digits: snprintf(), the digit loop in
+ *     set_nonce() and the odometer in increment_nonce()
+ *   - handing tasks to a worker through the task ring, the way
+ *     produce_tasks() feeds mine_queue(), and through the mutex/condvar
+ *     slot it replaced, against claiming them with an atomic fetch-add as
+ *     mine_atomic() does
+ *
+ * Compile:  make bench
+ * Run:      ./bench/primitives
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The miner itself, for scan_nonces() and the kernels and task ring */
+#define main mine_main
+#include "../mine.c"
+#undef main
+
+/* Every timed loop runs at least this long */
+#define MIN_SECONDS 0.2
+#define HANDOFFS 200000
+#define MAX_LANES 16
+
+/* Keeps the compiler from dropping work whose result is unused */
+volatile uint32_t sink;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Known answers, as lowercase hex of the digest (SHA-256d in display
+ * order, as mine --hash=sha256d prints it) */
+struct test_vector {
+    const char *message;
+    size_t repeat;  /* message is fed this many times */
+    const char *sha1;
+    const char *sha256d;
+};
+
+static const struct test_vector vectors[] = {
+    { "abc", 1,
+        "a9993e364706816aba3e25717850c26c9cd0d89d",
+        "58636c3ec08c12d55aedda056d602d5bcca72d8df6a69b519b72d32dc2428b4f" },
+    { "", 1,
+        "da39a3ee5e6b4b0d3255bfef95601890afd80709",
+        "56944c5d3f98413ef45cf54545538103cc9f298e0575820ad3591376e2e0f65d" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+        "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+        "af63952f8155cbb708b3b24997440992c95ebd5814fb843aac4d95687fe1ff0c" },
+    { "a", 1000000,
+        "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+        "88661512a78701a68778d78b5e70e50748fe1a9f74b206521b3e56779418d180" },
+};
+
+/* A multi-buffer kernel and whether this CPU can run it */
+struct lanes_kernel {
+    const char *name;
+    int lanes;
+    uint32_t (*scan)(const uint32_t midstate[], const uint32_t *words,
+            int nblocks, uint32_t limit);
+    bool supported;
+    sha1_lanes_from_fn scan_from;  /* SHA-1 only */
+};
+
+static struct lanes_kernel sha1_kernels[4];
+static struct lanes_kernel sha256d_kernels[4];
+static int num_sha1_kernels, num_sha256d_kernels;
+
+static void find_kernels(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    sha1_kernels[num_sha1_kernels++] = (struct lanes_kernel) { "sse2", 4,
+        sha1_x4_sse2, __builtin_cpu_supports("sse2"), sha1_x4_sse2_from };
+    sha1_kernels[num_sha1_kernels++] = (struct lanes_kernel) { "avx2", 8,
+        sha1_x8_avx2, __builtin_cpu_supports("avx2"), sha1_x8_avx2_from };
+    sha1_kernels[num_sha1_kernels++] = (struct lanes_kernel) { "avx512", 16,
+        sha1_x16_avx512, __builtin_cpu_supports("avx512f"), sha1_x16_avx512_from };
+    sha256d_kernels[num_sha256d_kernels++] = (struct lanes_kernel) { "sse2", 4,
+        sha256d_x4_sse2, __builtin_cpu_supports("sse2") };
+    sha256d_kernels[num_sha256d_kernels++] = (struct lanes_kernel) { "avx2", 8,
+        sha256d_x8_avx2, __builtin_cpu_supports("avx2") };
+    sha256d_kernels[num_sha256d_kernels++] = (struct lanes_kernel) { "avx512", 16,
+        sha256d_x16_avx512, __builtin_cpu_supports("avx512f") };
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    sha1_kernels[num_sha1_kernels++] = (struct lanes_kernel) { "neon", 4,
+        sha1_x4_neon, true, sha1_x4_neon_from };
+    sha256d_kernels[num_sha256d_kernels++] = (struct lanes_kernel) { "neon", 4,
+        sha256d_x4_neon, true };
+#endif
+}
+
+static bool check(bool ok, const char *what) {
+    if (!ok)
+        printf("FAIL: %s\n", what);
+    return ok;
+}
+
+/* Function: random_tail
+ * ---------------------
+ * Fills nblocks blocks of words with random message bytes followed by
+ * proper padding, as build_tail() would lay them out.
+ */
+static void random_tail(uint32_t words[32], int nblocks) {
+    size_t len = nblocks == 1 ? rand() % 56 : 56 + rand() % 64;
+    memset(words, 0, sizeof(uint32_t) * 32);
+    size_t i;
+    for (i = 0; i < len; i++)
+        words[i / 4] |= (uint32_t) (rand() & 0xFF) << 8 * (3 - i % 4);
+    words[len / 4] |= 0x80u << 8 * (3 - len % 4);
+    words[16 * nblocks - 1] = (uint32_t) (64 + len) * 8;
+}
+
+/* Function: check_lanes
+ * ---------------------
+ * Runs a multi-buffer kernel over random tails and compares its hit mask
+ * with the reference front words, using one lane's own front word as the
+ * limit so the comparison is exact at the boundary. The tails share a
+ * random number of leading words, and a kernel with a scan_from entry is
+ * also run from the prefix of those.
+ */
+static bool check_lanes(const struct lanes_kernel *kernel, const uint32_t *midstate,
+        uint32_t (*front)(const uint32_t *midstate, const uint32_t *words, int nblocks)) {
+    int trial;
+    for (trial = 0; trial < 200; trial++) {
+        int nblocks = 1 + trial % 2;
+        uint32_t tails[MAX_LANES][32];
+        uint32_t fronts[MAX_LANES] = { 0 };
+        uint32_t lane_words[32 * MAX_LANES];
+        int shared = rand() % (16 * nblocks);
+        int lane, t;
+        for (lane = 0; lane < kernel->lanes; lane++) {
+            random_tail(tails[lane], nblocks);
+            memcpy(tails[lane], tails[0], sizeof(uint32_t) * shared);
+            fronts[lane] = front(midstate, tails[lane], nblocks);
+            for (t = 0; t < 16 * nblocks; t++)
+                lane_words[t * kernel->lanes + lane] = tails[lane][t];
+        }
+
+        uint32_t limit = fronts[trial % kernel->lanes];
+        uint32_t expected = 0;
+        for (lane = 0; lane < kernel->lanes; lane++)
+            if (fronts[lane] <= limit)
+                expected |= 1u << lane;
+        if (kernel->scan(midstate, lane_words, nblocks, limit) != expected)
+            return false;
+        if (kernel->scan_from != NULL) {
+            struct scan_prefix prefix;
+            sha1_scan_prefix(&prefix, midstate, tails[0], nblocks, shared);
+            if (kernel->scan_from(&prefix, lane_words, limit) != expected)
+                return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t sha1_front_reference(const uint32_t *midstate, const uint32_t *words,
+        int nblocks) {
+    uint32_t state[5];
+    memcpy(state, midstate, sizeof(state));
+    int b;
+    for (b = 0; b < nblocks; b++)
+        SHA1CompressWords(state, words + 16 * b);
+    return state[0];
+}
+
+/* Ranges for check_scan(). The ends of most agree in their last digits or
+ * low bytes, which still count through every value in between. */
+struct scan_case {
+    const char *data;
+    enum nonce_format format;
+    size_t offset;  /* of a binary nonce */
+    uint64_t first, last;
+};
+
+static const struct scan_case scan_cases[] = {
+    { "Hello CS 220!!!", NONCE_DECIMAL, 0, 110961, 131071 },
+    { "Hello CS 220!!!", NONCE_DECIMAL, 0, 1001, 9001 },
+    { "Hello CS 220!!!", NONCE_DECIMAL, 0, 99000, 101000 },
+    { "A block tail that runs past the first padded block :)", NONCE_DECIMAL, 0,
+        346001, 351001 },
+    { "Hello CS 220!!!", NONCE_BINARY_LE, 3, 256, 768 },
+    { "Hello CS 220!!!", NONCE_BINARY_LE, 3, 0x1FF00, 0x20F00 },
+    { "Hello CS 220!!!", NONCE_BINARY_BE, 3, 0x1FF00, 0x20F00 },
+    { "Hello CS 220!!!", NONCE_BINARY_BE, 0, 0x10000FF, 0x10010FF },
+};
+
+/* Function: scan_all
+ * ------------------
+ * returns: how many nonces in [first, last] scan_nonces() finds meeting
+ *          target with the current engine, their offsets written to found
+ */
+static int scan_all(struct thread_info *info, uint64_t first, uint64_t last,
+        const uint32_t target[HASH_MAX_WORDS], int found[], int max) {
+    uint32_t hash[HASH_MAX_WORDS];
+    uint64_t start = first;
+    int n = 0;
+    while (start <= last && n < max) {
+        int at = scan_nonces(info, start, last - start + 1, target, hash);
+        if (at < 0)
+            break;
+        found[n++] = start + at - first;
+        start += at + 1;
+    }
+    return n;
+}
+
+/* Function: check_scan
+ * --------------------
+ * Runs scan_nonces() over scan_cases[] with kernel in the engine, and
+ * compares the nonces it finds with those found hashing one at a time.
+ *
+ * hash: engine the kernel belongs to
+ */
+static bool check_scan(const char *hash, const struct lanes_kernel *kernel) {
+    static struct hash_buffers buf;
+    struct thread_info info = { .buf = &buf };
+    uint32_t target[HASH_MAX_WORDS];
+    int i;
+    for (i = 0; i < HASH_MAX_WORDS; i++)
+        target[i] = UINT32_MAX;
+    target[0] = 0x03FFFFFF;  /* about one nonce in 64 */
+
+    bool ok = true;
+    size_t c;
+    for (c = 0; c < sizeof(scan_cases) / sizeof(scan_cases[0]); c++) {
+        const struct scan_case *sc = &scan_cases[c];
+        nonce_format = sc->format;
+        nonce_offset = sc->format == NONCE_DECIMAL ? SIZE_MAX : sc->offset;
+        hash_select_engine(hash, "portable", &engine);
+        struct job *job = job_create(sc->data, target);
+        info.job = job;
+        load_message(&info);
+
+        static int expected[4096], found[4096];
+        engine.scan = NULL;
+        engine.scan_from = NULL;
+        engine.lanes = 1;
+        int num_expected = scan_all(&info, sc->first, sc->last, target, expected, 4096);
+
+        engine.scan = kernel->scan;
+        engine.scan_from = kernel->scan_from;
+        engine.lanes = kernel->lanes;
+        int num_found = scan_all(&info, sc->first, sc->last, target, found, 4096);
+
+        ok &= num_expected > 0 && num_found == num_expected
+            && memcmp(found, expected, sizeof(int) * num_found) == 0;
+        job_free(job);
+    }
+    nonce_format = NONCE_DECIMAL;
+    nonce_offset = SIZE_MAX;
+    return ok;
+}
+
+/* Function: validate
+ * ------------------
+ * returns: true if every kernel agrees with the known answers
+ */
+static bool validate(void) {
+    bool ok = true;
+    size_t v;
+    for (v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+        const struct test_vector *tv = &vectors[v];
+        size_t len = strlen(tv->message);
+        char what[128];
+        snprintf(what, sizeof(what), "SHA-1 of \"%.20s\"%s", tv->message,
+                tv->repeat > 1 ? " repeated" : "");
+
+        SHA1Context context;
+        SHA1Reset(&context);
+        size_t r;
+        for (r = 0; r < tv->repeat; r++)
+            SHA1Input(&context, (const uint8_t *) tv->message, len);
+        uint8_t digest[20];
+        SHA1Result(&context, digest);
+        char hex[65];
+        int i;
+        for (i = 0; i < 20; i++)
+            sprintf(hex + 2 * i, "%02x", digest[i]);
+        ok &= check(strcmp(hex, tv->sha1) == 0, what);
+
+        char *message = malloc(len * tv->repeat + 1);
+        for (r = 0; r < tv->repeat; r++)
+            memcpy(message + r * len, tv->message, len);
+        message[len * tv->repeat] = '\0';
+
+        if (tv->repeat == 1) {
+            sha1sum(digest, message);
+            for (i = 0; i < 20; i++)
+                sprintf(hex + 2 * i, "%02x", digest[i]);
+            snprintf(what, sizeof(what), "sha1sum() of \"%.20s\"", tv->message);
+            ok &= check(strcmp(hex, tv->sha1) == 0, what);
+        }
+
+        uint32_t hash[8];
+        sha256d_digest(hash, message, len * tv->repeat);
+        for (i = 0; i < 8; i++)
+            sprintf(hex + 8 * i, "%08x", hash[i]);
+        snprintf(what, sizeof(what), "SHA-256d of \"%.20s\"%s", tv->message,
+                tv->repeat > 1 ? " repeated" : "");
+        ok &= check(strcmp(hex, tv->sha256d) == 0, what);
+        free(message);
+    }
+
+    /* Starts from a midstate that isn't the IV, as a long block would */
+    uint32_t midstate[8];
+    uint32_t sha1_state[5];
+    sha256midstate(midstate, "0123456789abcdef0123456789abcdef"
+            "0123456789abcdef0123456789abcdef", 64);
+    SHA1Context context;
+    sha1midstate(&context, "0123456789abcdef0123456789abcdef"
+            "0123456789abcdef0123456789abcdef", 64);
+    memcpy(sha1_state, context.Intermediate_Hash, sizeof(sha1_state));
+
+    if (sha1_hw_available()) {
+        int trial;
+        bool same = true;
+        for (trial = 0; trial < 1000; trial++) {
+            uint32_t words[32], a[5], b[5];
+            random_tail(words, 1);
+            memcpy(a, sha1_state, sizeof(a));
+            memcpy(b, sha1_state, sizeof(b));
+            SHA1CompressWords(a, words);
+            sha1_compress_hw(b, words);
+            same &= memcmp(a, b, sizeof(a)) == 0
+                && sha1_front_hw(sha1_state, words) == a[0];
+        }
+        ok &= check(same, "SHA-1 hardware kernel");
+    }
+
+    int k;
+    for (k = 0; k < num_sha1_kernels; k++) {
+        if (!sha1_kernels[k].supported)
+            continue;
+        char what[64];
+        snprintf(what, sizeof(what), "SHA-1 %s kernel", sha1_kernels[k].name);
+        ok &= check(check_lanes(&sha1_kernels[k], sha1_state, sha1_front_reference), what);
+        snprintf(what, sizeof(what), "scan_nonces() with the SHA-1 %s kernel",
+                sha1_kernels[k].name);
+        ok &= check(check_scan("sha1", &sha1_kernels[k]), what);
+    }
+    for (k = 0; k < num_sha256d_kernels; k++) {
+        if (!sha256d_kernels[k].supported)
+            continue;
+        char what[64];
+        snprintf(what, sizeof(what), "SHA-256d %s kernel", sha256d_kernels[k].name);
+        ok &= check(check_lanes(&sha256d_kernels[k], midstate, sha256d_front), what);
+        snprintf(what, sizeof(what), "scan_nonces() with the SHA-256d %s kernel",
+                sha256d_kernels[k].name);
+        ok &= check(check_scan("sha256d", &sha256d_kernels[k]), what);
+    }
+    return ok;
+}
+
+/* Function: time_compress
+ * -----------------------
+ * returns: ns per block for a one-block compression function
+ */
+static double time_compress(void (*compress)(uint32_t *state, const uint32_t *words)) {
+    uint32_t words[16] = { 0 };
+    uint32_t state[5] = { 0 };
+    uint64_t blocks = 0;
+    double start = now(), elapsed;
+    do {
+        int i;
+        for (i = 0; i < 4096; i++) {
+            compress(state, words);
+            words[0]++;
+        }
+        blocks += 4096;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+    sink += state[0];
+    return elapsed * 1e9 / blocks;
+}
+
+static void compress_reference(uint32_t *state, const uint32_t *words) {
+    SHA1CompressWords(state, words);
+}
+
+static void compress_hw(uint32_t *state, const uint32_t *words) {
+    sha1_compress_hw(state, words);
+}
+
+/* Function: time_lanes
+ * --------------------
+ * returns: ns per block per lane for a multi-buffer kernel
+ */
+static double time_lanes(const struct lanes_kernel *kernel, const uint32_t *midstate) {
+    uint32_t words[16 * MAX_LANES] = { 0 };
+    uint64_t blocks = 0;
+    double start = now(), elapsed;
+    do {
+        int i;
+        for (i = 0; i < 4096; i++) {
+            sink += kernel->scan(midstate, words, 1, sink);
+            words[0]++;
+        }
+        blocks += 4096 * kernel->lanes;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+    return elapsed * 1e9 / blocks;
+}
+
+static double time_sha256d_front(void) {
+    uint32_t words[16] = { 0 };
+    uint32_t midstate[8] = { 0 };
+    uint64_t hashes = 0;
+    double start = now(), elapsed;
+    do {
+        int i;
+        for (i = 0; i < 1024; i++) {
+            sink += sha256d_front(midstate, words, 1);
+            words[0]++;
+        }
+        hashes += 1024;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+    return elapsed * 1e9 / hashes;
+}
+
+/* Function: time_sha1sum
+ * ----------------------
+ * returns: ns per call of sha1sum() on a message of len bytes
+ */
+static double time_sha1sum(size_t len) {
+    char *message = malloc(len + 1);
+    memset(message, 'x', len);
+    message[len] = '\0';
+    uint8_t digest[20];
+    uint64_t calls = 0;
+    double start = now(), elapsed;
+    do {
+        int i;
+        for (i = 0; i < 256; i++) {
+            sha1sum(digest, message);
+            sink += digest[0];
+        }
+        calls += 256;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+    free(message);
+    return elapsed * 1e9 / calls;
+}
+
+/* The nonce writers being compared; each returns the digit count */
+static size_t format_snprintf(char *out, uint64_t nonce) {
+    return snprintf(out, 21, "%" PRIu64, nonce);
+}
+
+/* The digit loop of set_nonce() */
+static size_t format_digits(char *out, uint64_t nonce) {
+    char buf[20];
+    size_t len = 0;
+    do {
+        buf[len++] = '0' + nonce % 10;
+        nonce /= 10;
+    } while (nonce > 0);
+    size_t i;
+    for (i = 0; i < len; i++)
+        out[i] = buf[len - 1 - i];
+    return len;
+}
+
+/* Function: time_format
+ * ---------------------
+ * returns: ns per nonce for writing consecutive nonces from 10^9 up
+ */
+static double time_format(size_t (*format)(char *out, uint64_t nonce)) {
+    char out[32];
+    uint64_t nonce = 1000000000;
+    uint64_t count = 0;
+    double start = now(), elapsed;
+    do {
+        int i;
+        for (i = 0; i < 4096; i++)
+            sink += format(out, nonce++) + out[0];
+        count += 4096;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+    return elapsed * 1e9 / count;
+}
+
+/* Function: time_odometer
+ * -----------------------
+ * Like time_format(), but stepping from one nonce to the next the way
+ * increment_nonce() does.
+ */
+static double time_odometer(void) {
+    char digits[32] = "1000000000";
+    size_t num_digits = 10;
+    uint64_t count = 0;
+    double start = now(), elapsed;
+    do {
+        int n;
+        for (n = 0; n < 4096; n++) {
+            size_t i = num_digits;
+            while (i > 0 && digits[i - 1] == '9')
+                digits[--i] = '0';
+            if (i > 0) {
+                digits[i - 1]++;
+            } else {
+                digits[0] = '1';
+                digits[num_digits++] = '0';
+            }
+            sink += digits[num_digits - 1];
+        }
+        count += 4096;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+    return elapsed * 1e9 / count;
+}
+
+/* The queue scheduler's old handoff: one task slot, a producer that waits for
+ * it to empty and a consumer that waits for it to fill */
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slot_staging = PTHREAD_COND_INITIALIZER;
+static uint64_t *slot;
+
+static void *slot_consumer(void *arg) {
+    int n;
+    for (n = 0; n < HANDOFFS; n++) {
+        pthread_mutex_lock(&slot_mutex);
+        while (slot == NULL)
+            pthread_cond_wait(&slot_ready, &slot_mutex);
+        uint64_t *task = slot;
+        slot = NULL;
+        pthread_cond_signal(&slot_staging);
+        pthread_mutex_unlock(&slot_mutex);
+        sink += *task;
+        free(task);
+    }
+    return NULL;
+}
+
+/* Function: time_condvar_handoff
+ * ------------------------------
+ * returns: ns per task passed through the slot to another thread
+ */
+static double time_condvar_handoff(void) {
+    pthread_t consumer;
+    double start = now();
+    pthread_create(&consumer, NULL, slot_consumer, NULL);
+    int n;
+    for (n = 0; n < HANDOFFS; n++) {
+        uint64_t *task = malloc(sizeof(uint64_t));
+        *task = n;
+        pthread_mutex_lock(&slot_mutex);
+        while (slot != NULL)
+            pthread_cond_wait(&slot_staging, &slot_mutex);
+        slot = task;
+        pthread_cond_signal(&slot_ready);
+        pthread_mutex_unlock(&slot_mutex);
+    }
+    pthread_join(consumer, NULL);
+    return (now() - start) * 1e9 / HANDOFFS;
+}
+
+static struct task_ring ring;
+
+/* Both ends know how many tasks to expect, so there is no stop condition */
+static bool never(void *arg) {
+    return false;
+}
+
+static void *ring_consumer(void *arg) {
+    struct task tasks[TASK_BATCH];
+    int n = 0;
+    while (n < HANDOFFS) {
+        int got = task_ring_pop(&ring, tasks, TASK_BATCH);
+        if (got == 0) {
+            task_ring_park(&ring, true, never, NULL);
+            continue;
+        }
+        int i;
+        for (i = 0; i < got; i++)
+            sink += tasks[i].start;
+        n += got;
+    }
+    return NULL;
+}
+
+/* Function: time_ring_handoff
+ * ---------------------------
+ * returns: ns per task passed through the task ring to another thread
+ */
+static double time_ring_handoff(void) {
+    pthread_t consumer;
+    task_ring_init(&ring);
+    double start = now();
+    pthread_create(&consumer, NULL, ring_consumer, NULL);
+    int n;
+    for (n = 0; n < HANDOFFS; n++) {
+        while (!task_ring_push(&ring, n, 1))
+            task_ring_park(&ring, false, never, NULL);
+    }
+    pthread_join(consumer, NULL);
+    return (now() - start) * 1e9 / HANDOFFS;
+}
+
+static _Atomic uint64_t next_task;
+
+static void *atomic_claimer(void *arg) {
+    int n;
+    for (n = 0; n < HANDOFFS; n++)
+        sink += atomic_fetch_add_explicit(&next_task, 1, memory_order_relaxed);
+    return NULL;
+}
+
+/* Function: time_atomic_claim
+ * ---------------------------
+ * returns: ns per task claimed with a fetch-add, by threads workers at once
+ */
+static double time_atomic_claim(int threads) {
+    pthread_t claimers[4];
+    double start = now();
+    int i;
+    for (i = 0; i < threads; i++)
+        pthread_create(&claimers[i], NULL, atomic_claimer, NULL);
+    for (i = 0; i < threads; i++)
+        pthread_join(claimers[i], NULL);
+    return (now() - start) * 1e9 / (HANDOFFS * threads);
+}
+
+int main(void) {
+    find_kernels();
+    if (!validate()) {
+        printf("Kernels disagree with the reference; not benchmarking\n");
+        return EXIT_FAILURE;
+    }
+    printf("All kernels match the test vectors\n\n");
+
+    uint32_t zero[8] = { 0 };
+    printf("SHA-1 compression (ns/block):\n");
+    printf("  %-10s %8.2f\n", "portable", time_compress(compress_reference));
+    if (sha1_hw_available())
+        printf("  %-10s %8.2f\n", SHA1_HW_NAME, time_compress(compress_hw));
+    int k;
+    for (k = 0; k < num_sha1_kernels; k++) {
+        if (sha1_kernels[k].supported)
+            printf("  %-10s %8.2f (per lane, %d lanes)\n", sha1_kernels[k].name,
+                    time_lanes(&sha1_kernels[k], zero), sha1_kernels[k].lanes);
+    }
+
+    printf("SHA-256d of one tail block (ns/hash):\n");
+    printf("  %-10s %8.2f\n", "portable", time_sha256d_front());
+    for (k = 0; k < num_sha256d_kernels; k++) {
+        if (sha256d_kernels[k].supported)
+            printf("  %-10s %8.2f (per lane, %d lanes)\n", sha256d_kernels[k].name,
+                    time_lanes(&sha256d_kernels[k], zero), sha256d_kernels[k].lanes);
+    }
+
+    printf("sha1sum() (ns/call):\n");
+    static const size_t lengths[] = { 16, 55, 56, 64, 256, 4096 };
+    size_t l;
+    for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+        printf("  %4zu bytes %9.2f\n", lengths[l], time_sha1sum(lengths[l]));
+
+    printf("Nonce formatting (ns/nonce):\n");
+    printf("  %-10s %8.2f\n", "snprintf", time_format(format_snprintf));
+    printf("  %-10s %8.2f\n", "digits", time_format(format_digits));
+    printf("  %-10s %8.2f\n", "odometer", time_odometer());
+
+    printf("Task handoff (ns/task):\n");
+    printf("  %-24s %8.2f\n", "task ring", time_ring_handoff());
+    printf("  %-24s %8.2f\n", "mutex/condvar slot", time_condvar_handoff());
+    printf("  %-24s %8.2f\n", "atomic claim, 1 thread", time_atomic_claim(1));
+    printf("  %-24s %8.2f\n", "atomic claim, 4 threads", time_atomic_claim(4));
+    return 0;
+}
@@ -0,0 +1,438 @@
+/**
+ * gpu.c
+ *
+ * Optional OpenCL backend (make GPU=opencl, which defines MINE_OPENCL).
+ * Every GPU gets a host thread that joins the worker pool like a CPU
+ * worker under the atomic scheduler: it claims GPU_BATCH nonces at a time
+ * off the job's next_nonce and launches one kernel over them. The kernel
+ * gets the job's midstate and the thread's padded tail words as a
+ * template, writes each work-item's nonce into its copy, and reports only
+ * the work-items whose front word is at most target[0]. Those few
+ * candidates are hashed again in full on the CPU before one is accepted.
+ *
+ * Only SHA-1 has a GPU kernel so far.
+ */
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/* Nonces per kernel launch, and most candidates one launch can report. A
+ * launch runs to completion even once a solution is found, so a batch is
+ * kept to a few milliseconds of work on a current GPU. */
+#define GPU_BATCH (1u << 24)
+#define GPU_MAX_CANDIDATES 1024
+#define GPU_MAX_DEVICES 16
+
+struct gpu_device {
+    char name[128];
+    cl_device_id id;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem midstate;    /* 5 words */
+    cl_mem tail;        /* 32 words */
+    cl_mem candidates;  /* count, then work-item ids */
+    struct thread_info *info;  /* host thread, with thread_id after the CPUs */
+};
+
+struct gpu_device gpu_devices[GPU_MAX_DEVICES];
+unsigned int num_gpu_devices;
+
+int gpu_init(const char *list);
+void gpu_start(unsigned int first_id);
+void gpu_stop(void);
+void gpu_print_rates(double total_time);
+struct thread_info *gpu_host_thread(unsigned int i);
+void *gpu_main(void *arg);
+
+/* One work-item per nonce; nonce_len and nonce_pos say where its decimal
+ * digits or binary bytes go in the tail (format 0 = decimal, 1 = binary
+ * little-endian, 2 = binary big-endian). Every nonce of a launch has the
+ * same length, so the template's padding is right for all of them. */
+static const char *gpu_kernel_source =
+"#define ROTL(n, x) rotate((uint) (x), (uint) (n))\n"
+"\n"
+"void put_byte(uint *w, uint pos, uint c) {\n"
+"    uint shift = 8 * (3 - (pos & 3));\n"
+"    w[pos >> 2] = (w[pos >> 2] & ~(0xFFu << shift)) | (c << shift);\n"
+"}\n"
+"\n"
+"void compress(uint *h, const uint *block, bool front_only) {\n"
+"    uint W[16];\n"
+"    uint a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f, k, t, tmp;\n"
+"    for (t = 0; t < 16; t++)\n"
+"        W[t] = block[t];\n"
+"    for (t = 0; t < 80; t++) {\n"
+"        if (t >= 16)\n"
+"            W[t & 15] = ROTL(1, W[(t - 3) & 15] ^ W[(t - 8) & 15]\n"
+"                    ^ W[(t - 14) & 15] ^ W[t & 15]);\n"
+"        if (t < 20) {\n"
+"            f = (b & c) | (~b & d);\n"
+"            k = 0x5A827999;\n"
+"        } else if (t < 40) {\n"
+"            f = b ^ c ^ d;\n"
+"            k = 0x6ED9EBA1;\n"
+"        } else if (t < 60) {\n"
+"            f = (b & c) | (b & d) | (c & d);\n"
+"            k = 0x8F1BBCDC;\n"
+"        } else {\n"
+"            f = b ^ c ^ d;\n"
+"            k = 0xCA62C1D6;\n"
+"        }\n"
+"        tmp = ROTL(5, a) + f + e + k + W[t & 15];\n"
+"        e = d;\n"
+"        d = c;\n"
+"        c = ROTL(30, b);\n"
+"        b = a;\n"
+"        a = tmp;\n"
+"    }\n"
+"    h[0] += a;\n"
+"    if (front_only)\n"
+"        return;\n"
+"    h[1] += b;\n"
+"    h[2] += c;\n"
+"    h[3] += d;\n"
+"    h[4] += e;\n"
+"}\n"
+"\n"
+"__kernel void scan(__constant uint *midstate, __constant uint *tail,\n"
+"        uint nblocks, ulong start, uint nonce_pos, uint nonce_len,\n"
+"        uint format, uint limit, __global uint *candidates,\n"
+"        uint max_candidates) {\n"
+"    uint id = get_global_id(0);\n"
+"    ulong nonce = start + id;\n"
+"    uint w[32], h[5];\n"
+"    uint i;\n"
+"    for (i = 0; i < 16 * nblocks; i++)\n"
+"        w[i] = tail[i];\n"
+"    if (format == 0) {\n"
+"        for (i = nonce_len; i-- > 0; nonce /= 10)\n"
+"            put_byte(w, nonce_pos + i, '0' + (uint) (nonce % 10));\n"
+"    } else {\n"
+"        for (i = 0; i < 8; i++) {\n"
+"            uint shift = 8 * (format == 1 ? i : 7 - i);\n"
+"            put_byte(w, nonce_pos + i, (uint) (nonce >> shift) & 0xFF);\n"
+"        }\n"
+"    }\n"
+"    for (i = 0; i < 5; i++)\n"
+"        h[i] = midstate[i];\n"
+"    for (i = 0; i < nblocks; i++)\n"
+"        compress(h, w + 16 * i, i + 1 == nblocks);\n"
+"    if (h[0] <= limit) {\n"
+"        uint slot = atomic_inc(candidates);\n"
+"        if (slot < max_candidates)\n"
+"            candidates[1 + slot] = id;\n"
+"    }\n"
+"}\n";
+
+/* Function: gpu_open
+ * ------------------
+ * Creates the context, queue, kernel and buffers for one device.
+ *
+ * returns: 0, or -1 with a message printed
+ */
+static int gpu_open(struct gpu_device *gpu, cl_device_id id) {
+    cl_int err;
+    gpu->id = id;
+    clGetDeviceInfo(id, CL_DEVICE_NAME, sizeof(gpu->name), gpu->name, NULL);
+
+    gpu->context = clCreateContext(NULL, 1, &id, NULL, NULL, &err);
+    if (err != CL_SUCCESS)
+        goto fail;
+    gpu->queue = clCreateCommandQueue(gpu->context, id, 0, &err);
+    if (err != CL_SUCCESS)
+        goto fail;
+
+    gpu->program = clCreateProgramWithSource(gpu->context, 1,
+            &gpu_kernel_source, NULL, &err);
+    if (err != CL_SUCCESS)
+        goto fail;
+    err = clBuildProgram(gpu->program, 1, &id, "", NULL, NULL);
+    if (err != CL_SUCCESS) {
+        char log[4096] = "";
+        clGetProgramBuildInfo(gpu->program, id, CL_PROGRAM_BUILD_LOG,
+                sizeof(log) - 1, log, NULL);
+        printf("ERROR: Could not build the GPU kernel for %s:\n%s\n", gpu->name, log);
+        return -1;
+    }
+    gpu->kernel = clCreateKernel(gpu->program, "scan", &err);
+    if (err != CL_SUCCESS)
+        goto fail;
+
+    gpu->midstate = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY,
+            sizeof(cl_uint) * 5, NULL, &err);
+    if (err != CL_SUCCESS)
+        goto fail;
+    gpu->tail = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY,
+            sizeof(cl_uint) * 32, NULL, &err);
+    if (err != CL_SUCCESS)
+        goto fail;
+    gpu->candidates = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
+            sizeof(cl_uint) * (1 + GPU_MAX_CANDIDATES), NULL, &err);
+    if (err != CL_SUCCESS)
+        goto fail;
+    return 0;
+
+fail:
+    printf("ERROR: Could not set up GPU %s (OpenCL error %d)\n", gpu->name, err);
+    return -1;
+}
+
+/* Function: gpu_init
+ * ------------------
+ * Opens the GPUs to mine on.
+ *
+ * list: "all", or device numbers across all platforms such as "0,2"
+ *       (parse_cpu_list() syntax)
+ *
+ * returns: number of devices opened, or -1
+ */
+int gpu_init(const char *list) {
+    cl_platform_id platforms[8];
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(8, platforms, &num_platforms) != CL_SUCCESS
+            || num_platforms == 0) {
+        printf("ERROR: No OpenCL platforms found\n");
+        return -1;
+    }
+
+    cl_device_id all[GPU_MAX_DEVICES];
+    cl_uint count = 0;
+    cl_uint p;
+    for (p = 0; p < num_platforms && count < GPU_MAX_DEVICES; p++) {
+        cl_uint n = 0;
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_GPU,
+                    GPU_MAX_DEVICES - count, all + count, &n) == CL_SUCCESS)
+            count += n;
+    }
+    if (count == 0) {
+        printf("ERROR: No OpenCL GPUs found\n");
+        return -1;
+    }
+
+    int chosen[GPU_MAX_DEVICES];
+    int num_chosen;
+    if (strcmp(list, "all") == 0) {
+        for (num_chosen = 0; num_chosen < count; num_chosen++)
+            chosen[num_chosen] = num_chosen;
+    } else {
+        num_chosen = parse_cpu_list(list, chosen, GPU_MAX_DEVICES);
+        if (num_chosen <= 0) {
+            printf("ERROR: Invalid GPU list '%s'\n", list);
+            return -1;
+        }
+    }
+
+    int i;
+    for (i = 0; i < num_chosen; i++) {
+        if (chosen[i] >= count) {
+            printf("ERROR: There is no GPU %d\n", chosen[i]);
+            return -1;
+        }
+        if (gpu_open(&gpu_devices[num_gpu_devices], all[chosen[i]]) != 0)
+            return -1;
+        fprintf(log_out, "GPU %d: %s\n", chosen[i], gpu_devices[num_gpu_devices].name);
+        num_gpu_devices++;
+    }
+    return num_gpu_devices;
+}
+
+/* Function: gpu_start
+ * -------------------
+ * Starts a host thread for every device. They wait for jobs with
+ * wait_for_job() like the CPU workers.
+ *
+ * first_id: thread_id of the first device's host thread
+ */
+void gpu_start(unsigned int first_id) {
+    unsigned int i;
+    for (i = 0; i < num_gpu_devices; i++) {
+        struct thread_info *info = aligned_alloc(CACHE_LINE, sizeof(struct thread_info));
+        memset(info, 0, sizeof(struct thread_info));
+        info->thread_id = first_id + i;
+        info->cpu = -1;
+        if (arena_init(&info->arena, sizeof(struct hash_buffers)) < 0) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        gpu_devices[i].info = info;
+        if (pthread_create(&info->thread_handle, NULL, gpu_main, &gpu_devices[i]) != 0) {
+            printf("ERROR: Could not start the host thread for GPU %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Function: gpu_host_thread
+ * -------------------------
+ * returns: the host thread of GPU i, for the stats thread to sample
+ */
+struct thread_info *gpu_host_thread(unsigned int i) {
+    return gpu_devices[i].info;
+}
+
+/* Function: gpu_stop
+ * ------------------
+ * Waits for the host threads to exit (after pool_shutdown is set) and
+ * releases the devices.
+ */
+void gpu_stop(void) {
+    unsigned int i;
+    for (i = 0; i < num_gpu_devices; i++) {
+        struct gpu_device *gpu = &gpu_devices[i];
+        pthread_join(gpu->info->thread_handle, NULL);
+        arena_destroy(&gpu->info->arena);
+        free(gpu->info);
+        clReleaseMemObject(gpu->candidates);
+        clReleaseMemObject(gpu->tail);
+        clReleaseMemObject(gpu->midstate);
+        clReleaseKernel(gpu->kernel);
+        clReleaseProgram(gpu->program);
+        clReleaseCommandQueue(gpu->queue);
+        clReleaseContext(gpu->context);
+    }
+}
+
+/* Function: gpu_scan
+ * ------------------
+ * Runs one kernel over nonces [start, start + count), which must all have
+ * the same length, and checks its candidates on the CPU.
+ *
+ * returns: true if a solution was found
+ */
+static bool gpu_scan(struct gpu_device *gpu, uint64_t start, cl_uint count) {
+    struct thread_info *info = gpu->info;
+    struct job *job = info->job;
+
+    /* The tail of the first nonce is the template for all of them */
+    set_nonce(info, start);
+    cl_uint zero = 0;
+    clEnqueueWriteBuffer(gpu->queue, gpu->tail, CL_FALSE, 0,
+            sizeof(cl_uint) * 32, info->buf->tail_words, 0, NULL, NULL);
+    clEnqueueWriteBuffer(gpu->queue, gpu->candidates, CL_FALSE, 0,
+            sizeof(cl_uint), &zero, 0, NULL, NULL);
+
+    cl_uint nblocks = info->buf->tail_blocks;
+    cl_ulong first = start;
+    cl_uint nonce_pos = job->nonce_pos;
+    cl_uint nonce_len = info->buf->num_digits;
+    cl_uint format = nonce_format;
+    cl_uint limit = job->target[0];
+    cl_uint max_candidates = GPU_MAX_CANDIDATES;
+    clSetKernelArg(gpu->kernel, 0, sizeof(cl_mem), &gpu->midstate);
+    clSetKernelArg(gpu->kernel, 1, sizeof(cl_mem), &gpu->tail);
+    clSetKernelArg(gpu->kernel, 2, sizeof(cl_uint), &nblocks);
+    clSetKernelArg(gpu->kernel, 3, sizeof(cl_ulong), &first);
+    clSetKernelArg(gpu->kernel, 4, sizeof(cl_uint), &nonce_pos);
+    clSetKernelArg(gpu->kernel, 5, sizeof(cl_uint), &nonce_len);
+    clSetKernelArg(gpu->kernel, 6, sizeof(cl_uint), &format);
+    clSetKernelArg(gpu->kernel, 7, sizeof(cl_uint), &limit);
+    clSetKernelArg(gpu->kernel, 8, sizeof(cl_mem), &gpu->candidates);
+    clSetKernelArg(gpu->kernel, 9, sizeof(cl_uint), &max_candidates);
+
+    size_t global = count;
+    cl_int err = clEnqueueNDRangeKernel(gpu->queue, gpu->kernel, 1, NULL,
+            &global, NULL, 0, NULL, NULL);
+    cl_uint found[1 + GPU_MAX_CANDIDATES];
+    if (err == CL_SUCCESS) {
+        err = clEnqueueReadBuffer(gpu->queue, gpu->candidates, CL_TRUE, 0,
+                sizeof(found), found, 0, NULL, NULL);
+    }
+    if (err != CL_SUCCESS) {
+        printf("ERROR: GPU %s failed (OpenCL error %d)\n", gpu->name, err);
+        exit(EXIT_FAILURE);
+    }
+    /* Only the front word has been tested so far */
+    cl_uint i;
+    cl_uint candidates = found[0] < GPU_MAX_CANDIDATES ? found[0] : GPU_MAX_CANDIDATES;
+    for (i = 0; i < candidates; i++) {
+        uint32_t hash[HASH_MAX_WORDS];
+        set_nonce(info, start + found[1 + i]);
+        hash_tail(info, hash);
+        if (meets_target(hash, job->target)) {
+            count_hashes(info, count);
+            record_solution(info, start + found[1 + i], hash);
+            return true;
+        }
+    }
+    if (found[0] > GPU_MAX_CANDIDATES) {
+        /* A target this easy fills the candidate list; the CPU can afford
+         * to check what the list had no room for */
+        return mine_range(info, start, count);
+    }
+    count_hashes(info, count);
+    return false;
+}
+
+/* Function: gpu_main
+ * ------------------
+ * Host thread for one GPU: mines each job the pool is given until the pool
+ * shuts down.
+ *
+ * arg: the device
+ */
+void *gpu_main(void *arg) {
+    struct gpu_device *gpu = arg;
+    struct thread_info *info = gpu->info;
+    info->buf = arena_alloc(&info->arena, sizeof(struct hash_buffers));
+
+    unsigned long generation = 0;
+    struct job *job;
+    while ((job = wait_for_job(&generation)) != NULL) {
+        info->job = job;
+        load_message(info);
+        clEnqueueWriteBuffer(gpu->queue, gpu->midstate, CL_TRUE, 0,
+                sizeof(cl_uint) * 5, job->midstate, 0, NULL, NULL);
+
+        uint64_t hashed = info->num_inversions;
+        while (!atomic_load_explicit(&job->solution_found, memory_order_relaxed)) {
+            uint64_t start = atomic_fetch_add(&job->next_nonce, GPU_BATCH);
+            if (start >= job->range_end || start > UINT64_MAX - GPU_BATCH)
+                break;
+            uint64_t end = start + GPU_BATCH;
+            if (end > job->range_end)
+                end = job->range_end;
+
+            /* Split the batch where decimal nonces gain a digit */
+            while (start < end) {
+                uint64_t piece_end = end;
+                if (nonce_format == NONCE_DECIMAL) {
+                    uint64_t power = 10;
+                    while (power <= start && power <= UINT64_MAX / 10)
+                        power *= 10;
+                    if (power > start && power < piece_end)
+                        piece_end = power;
+                }
+                if (gpu_scan(gpu, start, piece_end - start))
+                    break;
+                start = piece_end;
+            }
+        }
+        info->stop_time = get_time();
+        finish_job(info, info->num_inversions - hashed);
+    }
+
+    return NULL;
+}
+
+/* Function: gpu_print_rates
+ * -------------------------
+ * Splits the hash rate of the last job between the CPU workers and each
+ * GPU.
+ */
+void gpu_print_rates(double total_time) {
+    uint64_t cpu = 0;
+    unsigned int i;
+    for (i = 0; i < num_workers; i++)
+        cpu += workers[i]->num_inversions;
+    printf("  CPU (%u threads): %.2f hashes/sec\n", num_workers, cpu / total_time);
+    for (i = 0; i < num_gpu_devices; i++) {
+        printf("  GPU %u (%s): %.2f hashes/sec\n", i, gpu_devices[i].name,
+                gpu_devices[i].info->num_inversions / total_time);
+    }
+}
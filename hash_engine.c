@@ -0,0 +1,199 @@
+/**
+ * hash_engine.c
+ *
+ * The proof-of-work hash the miner searches with, behind one interface so
+ * the schedulers and everything around them don't care which it is. An
+ * engine knows how to absorb the data in front of the nonce into a
+ * midstate, how to finish a hash from it and the padded tail words laid out
+ * by build_tail(), and optionally how to test several tails at once. Each
+ * engine picks the fastest of its own kernels for the running CPU, unless
+ * one is asked for by name (--kernel).
+ *
+ * Engines: "sha1" (the default; see sha1_simd.c and sha1_hw.c for its
+ * kernels) and "sha256d" (double SHA-256 as in Bitcoin, see sha256.c). Both
+ * pad messages the same way and use big-endian words, so the tail layout
+ * is shared.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Words in the largest digest, and so in a target */
+#define HASH_MAX_WORDS 8
+
+typedef uint32_t (*hash_lanes_fn)(const uint32_t midstate[], const uint32_t *words,
+        int nblocks, uint32_t limit);
+
+struct hash_engine {
+    const char *name;    /* as given to --hash */
+    const char *kernel;  /* backend in use, for the log */
+    int words;           /* 32-bit words in a digest and a target */
+    int lanes;
+
+    /* Bitmask of the lanes whose word 0 is at most limit; NULL when
+     * hashing one message at a time */
+    hash_lanes_fn scan;
+
+    /* Optional: scan from the work shared by tails that only differ from
+     * word first_word on, set up once with prefix(); NULL if the engine
+     * always starts from the midstate */
+    void (*prefix)(struct scan_prefix *prefix, const uint32_t midstate[],
+            const uint32_t *words, int nblocks, int first_word);
+    uint32_t (*scan_from)(const struct scan_prefix *prefix, const uint32_t *words,
+            uint32_t limit);
+
+    /* Finish a hash of nblocks tail blocks, in full or just word 0 */
+    void (*hash)(const uint32_t midstate[], const uint32_t *words, int nblocks,
+            uint32_t hash[]);
+    uint32_t (*front)(const uint32_t midstate[], const uint32_t *words,
+            int nblocks);
+
+    /* Absorbs the full 64-byte blocks of data; returns how many bytes */
+    size_t (*midstate)(uint32_t state[], const char *data, size_t len);
+
+    /* One-shot reference hash of a whole message */
+    void (*digest)(uint32_t hash[], const char *message, size_t len);
+};
+
+int hash_select_engine(const char *name, const char *kernel,
+        struct hash_engine *engine);
+void hash_tostring(char out[], const uint32_t hash[], int words);
+
+/* SHA-1 kernel chosen by sha1_select_kernel() */
+static struct sha1_kernel sha1_backend;
+
+static void sha1_engine_hash(const uint32_t midstate[], const uint32_t *words,
+        int nblocks, uint32_t hash[]) {
+    memcpy(hash, midstate, sizeof(uint32_t) * 5);
+    int b;
+    for (b = 0; b < nblocks; b++)
+        sha1_backend.compress(hash, words + 16 * b);
+}
+
+/* Only works out word 0 of the last block, as sha1_backend.front does */
+static uint32_t sha1_engine_front(const uint32_t midstate[], const uint32_t *words,
+        int nblocks) {
+    uint32_t hash[5];
+    memcpy(hash, midstate, sizeof(hash));
+    int b;
+    for (b = 0; b + 1 < nblocks; b++)
+        sha1_backend.compress(hash, words + 16 * b);
+    return sha1_backend.front(hash, words + 16 * b);
+}
+
+static size_t sha1_engine_midstate(uint32_t state[], const char *data, size_t len) {
+    SHA1Context context;
+    size_t absorbed = sha1midstate(&context, data, len);
+    memcpy(state, context.Intermediate_Hash, sizeof(uint32_t) * 5);
+    return absorbed;
+}
+
+static void sha1_engine_digest(uint32_t hash[], const char *message, size_t len) {
+    SHA1Context context;
+    SHA1Reset(&context);
+    SHA1Input(&context, (const uint8_t *) message, len);
+    uint8_t digest[20];
+    SHA1Result(&context, digest);
+    int i;
+    for (i = 0; i < 5; i++) {
+        hash[i] = (uint32_t) digest[4 * i] << 24 | digest[4 * i + 1] << 16
+            | digest[4 * i + 2] << 8 | digest[4 * i + 3];
+    }
+}
+
+/* Function: hash_select_engine
+ * ----------------------------
+ * Sets up the named engine with the best kernel for this CPU, or with the
+ * named kernel.
+ *
+ * kernel: "portable", or one of the engine's kernels as logged; NULL or
+ *         "auto" for the best
+ *
+ * returns: 0, -1 if there is no engine of that name, or -2 if it has no
+ *          such kernel for this CPU
+ */
+int hash_select_engine(const char *name, const char *kernel,
+        struct hash_engine *engine) {
+    bool automatic = kernel == NULL || strcmp(kernel, "auto") == 0;
+
+    if (strcmp(name, "sha1") == 0) {
+        if (sha1_select_kernel(automatic ? NULL : kernel, &sha1_backend) != 0)
+            return -2;
+        engine->name = "sha1";
+        engine->kernel = sha1_backend.name;
+        engine->words = 5;
+        engine->lanes = sha1_backend.lanes;
+        engine->scan = sha1_backend.scan;
+        engine->prefix = sha1_scan_prefix;
+        engine->scan_from = sha1_backend.scan_from;
+        engine->hash = sha1_engine_hash;
+        engine->front = sha1_engine_front;
+        engine->midstate = sha1_engine_midstate;
+        engine->digest = sha1_engine_digest;
+        return 0;
+    }
+
+    if (strcmp(name, "sha256d") == 0) {
+        engine->name = "sha256d";
+        engine->kernel = "portable";
+        engine->words = 8;
+        engine->lanes = 1;
+        engine->scan = NULL;
+        engine->prefix = NULL;
+        engine->scan_from = NULL;
+        engine->hash = sha256d_tail;
+        engine->front = sha256d_front;
+        engine->midstate = sha256midstate;
+        engine->digest = sha256d_digest;
+        if (!automatic && strcmp(kernel, "portable") == 0)
+            return 0;
+
+        /* Widest first; without hardware SHA-256d there is nothing to
+         * calibrate against */
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+#endif
+        struct {
+            const char *name;
+            bool supported;
+            int lanes;
+            hash_lanes_fn scan;
+        } kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+            { "avx512", __builtin_cpu_supports("avx512f"), 16, sha256d_x16_avx512 },
+            { "avx2", __builtin_cpu_supports("avx2"), 8, sha256d_x8_avx2 },
+            { "sse2", __builtin_cpu_supports("sse2"), 4, sha256d_x4_sse2 },
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+            { "neon", true, 4, sha256d_x4_neon },
+#endif
+            { NULL, false, 0, NULL }
+        };
+        int k;
+        for (k = 0; kernels[k].name != NULL; k++) {
+            if (kernels[k].supported
+                    && (automatic || strcmp(kernel, kernels[k].name) == 0)) {
+                engine->kernel = kernels[k].name;
+                engine->lanes = kernels[k].lanes;
+                engine->scan = kernels[k].scan;
+                return 0;
+            }
+        }
+        return automatic ? 0 : -2;
+    }
+
+    return -1;
+}
+
+/* Function: hash_tostring
+ * -----------------------
+ * Writes hash (or a target) as uppercase hex, most significant word first.
+ *
+ * out: at least 8 * words + 1 characters
+ */
+void hash_tostring(char out[], const uint32_t hash[], int words) {
+    int i;
+    for (i = 0; i < words; i++)
+        out += sprintf(out, "%08X", hash[i]);
+}
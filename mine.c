@@ -1,11 +1,16 @@
+#define _GNU_SOURCE
+
 /**
  * mine.c
  *
  * Parallelizes the hash inversion technique used by cryptocurrencies such as
  * bitcoin.
  *
- * Input:    Number of threads, block difficulty, and block contents (string)
- * Output:   Hash inversion solution (nonce) and timing statistics.
+ * Input:    Number of threads, block difficulty, and block contents (string),
+ *           or with --batch, a file of "difficulty block-data" lines, or
+ *           with --listen, jobs submitted over a socket
+ * Output:   Hash inversion solution (nonce) and timing statistics, or one
+ *           result line per job in batch mode.
  *
  * Compile:  gcc -g -Wall mine.c -o mine
  *              (or run make)
@@ -14,294 +19,4068 @@
  *
  // * Run:      ./mine 4 24 'Hello CS 220!!!'
  *
- * Difficulty Mask: 00000000000000000000000011111111
+ * Target: 000000FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF
  * Number of threads: 4
- * . (NOTE: a '.' appears every 1,000,000 hashes to track progress)
+ * (NOTE: a stats line with the hash rate appears every second)
  * Solution found by thread 1:
  * Nonce: 1011686
  * Hash: 000000B976A3E2B94CB9AB668E0C9C727782787B
  * 1016000 hashes in 0.26s (3960056.52 hashes/sec)
+ *
+ * Batch:    ./mine --batch jobs.txt 4
+ *
+ * 1 1011686 000000B976A3E2B94CB9AB668E0C9C727782787B 1016000 0.260
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "sha1.c"
+#include "sha1_hw.c"
+#include "sha1_simd.c"
+#include "sha256.c"
+#include "hash_engine.c"
+#include "affinity.c"
+#include "arena.c"
+#include "task_ring.c"
+#include "net.c"
 
+/* Starting task size. With --task-size=auto (the default) workers double
+ * it whenever claiming tasks takes more than TASK_OVERHEAD_TARGET of their
+ * time, up to MAX_NONCES_PER_TASK or MAX_TASK_SECONDS of work per task. */
 #define NONCES_PER_TASK 120
+#define MAX_NONCES_PER_TASK (1 << 20)
+#define TASK_OVERHEAD_TARGET 0.01
+#define MAX_TASK_SECONDS 0.005
+#define TASK_SIZE_SAMPLES 16
+
+/* Workers look at solution_found at least this often (in nonces) while
+ * hashing, which bounds how much work is wasted after a solution */
+#define STOP_CHECK_INTERVAL 64
+
+/* Most jobs the work-stealing scheduler mines at once in batch or daemon
+ * mode */
+#define MAX_ACTIVE_JOBS 64
+
+/* Most tasks' worth of nonces a thief takes in one steal (so, as jobs start
+ * out with every nonce in one chunk, the nonces tried stay small) */
+#define STEAL_TASKS 64
+
+/* Nonces per range a distributed coordinator hands out (--range-size) */
+#define DEFAULT_RANGE_SIZE (1ULL << 24)
+
+/* The proof-of-work hash (--hash), set up before any target is parsed */
+struct hash_engine engine;
+
+/* How workers get their nonces. SCHED_QUEUE: a producer in main() queues
+ * tasks on a lock-free ring (task_ring.c) that the workers take them off.
+ * SCHED_ATOMIC: each worker claims the next nonces_per_task nonces off
+ * next_nonce with one fetch-add, with no producer, locks or task
+ * allocations. SCHED_STEAL: every worker has a deque of nonce ranges from
+ * any number of jobs and takes a task at a time off it, stealing from other
+ * workers' deques when its own runs dry; this is the only one that mines
+ * several jobs at once. */
+enum scheduler {
+    SCHED_QUEUE,
+    SCHED_ATOMIC,
+    SCHED_STEAL
+};
+enum scheduler scheduler = SCHED_ATOMIC;
+bool scheduler_set = false;
+uint64_t range_size = DEFAULT_RANGE_SIZE;
+bool task_size_auto = true;
+
+/* Stats lines are only printed unasked when mining a single job at the
+ * console; in batch output every line of stdout is a result. Other
+ * messages go to log_out (stderr in batch mode). */
+bool show_progress = true;
+FILE *log_out;
+
+/* Nonces [start, end) */
+struct range {
+    uint64_t start;
+    uint64_t end;
+};
+
+/* Sorted, non-overlapping and non-adjacent ranges */
+struct range_set {
+    struct range *ranges;
+    size_t count;
+    size_t capacity;
+};
+
+/* Nonces [start, end) of a job, as kept in the work-stealing deques */
+struct chunk {
+    struct job *job;
+    uint64_t start;
+    uint64_t end;
+};
+
+/* A worker's chunks, in a ring buffer that grows as needed. The owner takes
+ * chunks from the bottom and puts the rest of a split chunk back on top,
+ * so it cycles through all of its jobs a task at a time; thieves take (or
+ * halve) the chunk on top. */
+struct deque {
+    pthread_mutex_t lock;
+    struct chunk *chunks;
+    size_t capacity;
+    size_t top;
+    size_t count;
+};
+
+/* Everything above is read-only while mining. The variables that do get
+ * written are kept on cache lines of their own, so those writes never
+ * invalidate the lines the workers read for every task (or each other's). */
+#define CACHE_LINE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+
+/* A solution kept in find-all mode */
+struct found {
+    uint64_t nonce;
+    uint32_t hash[HASH_MAX_WORDS];
+};
+
+/* Solutions found by one worker: in the order found, or with top_k set a
+ * max-heap on the hash, so the worst one kept is items[0] */
+struct found_list {
+    struct found *items;
+    size_t count;
+    size_t capacity;
+};
+
+/* Ranges a worker has searched in full, on their way to the checkpoint
+ * thread: a single-producer, single-consumer ring where head is only
+ * written by the worker and tail only by the checkpoint thread */
+#define SEARCHED_LOG_SIZE 4096
+
+struct searched_log {
+    CACHE_ALIGNED _Atomic uint64_t head;
+    CACHE_ALIGNED _Atomic uint64_t tail;
+    struct range ranges[SEARCHED_LOG_SIZE];
+};
+
+/* Shares a worker has found, on their way to the share reporter: a ring
+ * like searched_log. dropped counts shares left out because the ring was
+ * full, and is only written by the worker. */
+#define SHARE_LOG_SIZE 1024
+
+struct share_log {
+    CACHE_ALIGNED _Atomic uint64_t head;
+    _Atomic uint64_t dropped;
+    CACHE_ALIGNED _Atomic uint64_t tail;
+    uint64_t reported;  /* taken off the ring so far, by the reporter */
+    struct found shares[SHARE_LOG_SIZE];
+};
+
+/* One block to mine. The members up to next_nonce are set by job_create()
+ * and only read while mining; the rest are written as described. */
+struct job {
+    unsigned long id;  /* line number in batch mode */
+    char *data;
+
+    /* Target as big-endian words (engine.words of them): a hash solves
+     * the block when it is numerically less than or equal to this. Word 0
+     * is tested for every hash; the rest only break ties. */
+    uint32_t target[HASH_MAX_WORDS];
+
+    /* Hash state after every full 64-byte block of data in front of the
+     * nonce; only the leftover bytes (tail) and the nonce are hashed per
+     * attempt. The nonce goes in at nonce_pos in the tail: at its end for
+     * decimal nonces, anywhere for binary ones. */
+    uint32_t midstate[HASH_MAX_WORDS];
+    uint64_t absorbed;
+    const char *tail;
+    size_t tail_len;
+    size_t nonce_pos;
+
+    /* Claimed by every worker with the atomic scheduler. With the
+     * work-stealing one, refs counts the chunks of the job that are queued
+     * or being hashed; the job is finished when it drops to zero. */
+    CACHE_ALIGNED _Atomic uint64_t next_nonce;
+    _Atomic unsigned int refs;
+
+    /* Read by every worker all the time, written once by record_solution() */
+    CACHE_ALIGNED atomic_bool solution_found;
+    double solution_time;
+    int solver;  /* thread_id of the winner */
+    uint64_t nonce;
+    char solution_hash[8 * HASH_MAX_WORDS + 1];
+
+    /* Totals from the workers as they finish, guarded by pool_mutex
+     * (except hashes, which is added to without it) */
+    CACHE_ALIGNED _Atomic uint64_t hashes;
+    double start_time;
+    double last_stop;
+    unsigned int workers_active;
+    bool finished;
+
+    /* Set for jobs nobody waits on (batch jobs under the work-stealing
+     * scheduler, and daemon jobs): called by the worker that finishes the
+     * job, which then belongs to the callback */
+    void (*on_finish)(struct job *job);
+
+    /* Daemon mode: index of the client that submitted the job (-1 once it
+     * has gone), whether it was cancelled, and the link in the list of
+     * finished jobs */
+    int client;
+    bool cancelled;
+    struct job *next_finished;
+
+    /* Nonces [range_start, range_end) are searched; distributed nodes get
+     * a slice, benchmark runs a fixed count, everyone else the lot. The
+     * queue scheduler's producer sets exhausted once it has queued the
+     * last of them, or stopped because of a solution. */
+    uint64_t range_start;
+    uint64_t range_end;
+    atomic_bool exhausted;
+};
+
+struct shared_state {
+    /* Read for every task, written a few times as it is tuned */
+    CACHE_ALIGNED _Atomic uint32_t nonces_per_task;
+
+    /* Queue scheduler tasks, from the producer to the workers */
+    CACHE_ALIGNED struct task_ring tasks;
+
+    /* Work-stealing: bumped whenever chunks are queued while workers are
+     * idle, and the number of idle workers (changed under pool_mutex) */
+    CACHE_ALIGNED _Atomic unsigned long work_seq;
+    _Atomic unsigned int idle_workers;
+};
+
+struct shared_state shared CACHE_ALIGNED = {
+    .nonces_per_task = NONCES_PER_TASK
+};
+
+/* The worker pool is started once and reused for every job: run_job()
+ * posts a job and bumps job_generation, the workers mine it until it is
+ * solved, and the last one to finish signals job_finished. Under the
+ * work-stealing scheduler jobs are pushed onto the workers' deques
+ * instead, idle workers sleep on work_available, and active_jobs counts
+ * the batch jobs in flight. */
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_posted = PTHREAD_COND_INITIALIZER;
+pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+struct job *current_job;
+unsigned long job_generation;
+bool pool_shutdown;
+unsigned int active_jobs;
+bool batch_failed;
+
+struct thread_info **workers;
+unsigned int num_workers;
+
+/* Checkpointing (--checkpoint, single-job mode only). The checkpoint thread
+ * merges the workers' searched_logs into searched every
+ * CHECKPOINT_DRAIN_SECONDS and writes it out every CHECKPOINT_SECONDS. A
+ * resumed run skips the ranges in resume_searched, which is read-only
+ * while mining. */
+#define CHECKPOINT_SECONDS 5.0
+#define CHECKPOINT_DRAIN_SECONDS 0.05
+
+const char *checkpoint_path;
+struct range_set searched;
+struct range_set resume_searched;
+atomic_bool checkpoint_done;
+struct job *interrupt_job;
+
+/* Find-all mode (--find-all, --top): rather than stopping at the first
+ * solution, every nonce in [range_start, range_end) is hashed and each
+ * worker keeps the solutions it finds in its own found_list. With top_k
+ * set, a worker only keeps its top_k best, and from then on only looks for
+ * hashes that beat the worst of them. */
+bool find_all;
+unsigned int top_k;
+
+/* Shares (--share-difficulty, single-job mode only): hashes that meet
+ * share_target, which is easier than the job's. Every worker reports its
+ * shares through its share_log without waiting, and the reporter thread
+ * prints them every SHARE_REPORT_SECONDS. */
+#define SHARE_REPORT_SECONDS 0.1
+
+bool shares_on;
+uint32_t share_target[HASH_MAX_WORDS];
+atomic_bool shares_done;
+
+/* Live statistics (--stats, --metrics): the stats thread samples the
+ * hash count and task wait time every worker (and GPU host thread)
+ * publishes in its thread_info, and prints a line every stats_interval
+ * seconds and/or serves them to Prometheus on metrics_fd. Workers never
+ * wait for it. A single job mined at the console gets a line every
+ * STATS_DEFAULT_SECONDS unless --stats says otherwise. */
+#define STATS_DEFAULT_SECONDS 1.0
+#define STATS_POLL_SECONDS 0.1
+
+double stats_interval = -1;  /* not set */
+bool stats_json;
+int metrics_fd = -1;
+pthread_t stats_thread;
+bool stats_running;
+atomic_bool stats_done;
+
+/* Benchmark mode (--bench): nonces hashed per run, and how many runs are
+ * thrown away before bench_runs are measured */
+uint64_t bench_nonces;
+unsigned int bench_warmup = 1;
+unsigned int bench_runs = 5;
+
+/* How the nonce is written into the message (--nonce-format): as decimal
+ * digits appended to the block data, or as a fixed NONCE_BYTES-byte
+ * integer inserted at nonce_offset (SIZE_MAX for the end of the data).
+ * Binary nonces keep the message length, and so its padding and block
+ * count, the same for every nonce. */
+enum nonce_format {
+    NONCE_DECIMAL,
+    NONCE_BINARY_LE,
+    NONCE_BINARY_BE
+};
+
+#define NONCE_BYTES 8
+
+enum nonce_format nonce_format = NONCE_DECIMAL;
+size_t nonce_offset = SIZE_MAX;
+
+/* Which CPU each worker is pinned to (see affinity.c) */
+enum affinity affinity = AFFINITY_NONE;
+int affinity_cpus[CPU_SETSIZE];
+int num_affinity_cpus;
+
+/* Profiling build (make profile, which defines MINE_PROFILE): every worker
+ * splits its time into the phases below by reading the CPU's tick counter
+ * at each phase boundary. PROFILE_LAP(info, phase) charges the ticks since
+ * the worker's last lap to phase. In the default build it compiles to
+ * nothing. */
+#ifdef MINE_PROFILE
+enum profile_phase {
+    PHASE_IDLE,    /* between jobs */
+    PHASE_WAIT,    /* getting a task: ring, atomic claim or steal */
+    PHASE_FORMAT,  /* writing nonces into the message and vector lanes */
+    PHASE_HASH,    /* hashing up to the front word */
+    PHASE_CHECK,   /* full hashes and target tests of likely solutions */
+    PHASE_OTHER,   /* everything else: range bookkeeping, logging */
+    NUM_PHASES
+};
+
+static const char *profile_phase_names[NUM_PHASES] = {
+    "idle", "wait", "format", "hash", "check", "other"
+};
+
+static inline uint64_t profile_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+#define PROFILE_LAP(info, phase)                                       \
+    do {                                                               \
+        uint64_t profile_now = profile_ticks();                        \
+        (info)->profile[phase] += profile_now - (info)->profile_mark;  \
+        (info)->profile_mark = profile_now;                            \
+    } while (0)
+#else
+#define PROFILE_LAP(info, phase) do { } while (0)
+#endif
 
-pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t task_staging = PTHREAD_COND_INITIALIZER;
-pthread_cond_t task_ready = PTHREAD_COND_INITIALIZER;
+/* A worker's hashing buffers. Allocated by the worker itself once it is
+ * running on its CPU, so the pages land on that CPU's NUMA node. */
+struct hash_buffers {
+    /* Per-thread message: the job's block tail is copied in once, with the
+     * current nonce at nonce_pos, rewritten in place. num_digits is the
+     * nonce's length in bytes, which only changes for decimal nonces. */
+    char message[128];
+    size_t num_digits;
 
-uint32_t difficulty_mask;
-char *bitcoin_block_data;
-uint64_t *task_pointer = NULL;
-bool solution_found = false;
+    /* The same message with SHA-1 padding and length applied, as big-endian
+     * words ready for compression. Rebuilt only when the digit count
+     * changes; otherwise rewritten digit by digit alongside message. */
+    uint32_t tail_words[32];
+    int tail_blocks;
+
+    /* tail_words of consecutive nonces transposed into vector lanes */
+    uint32_t lane_words[32 * SHA1_MAX_LANES];
+};
 
-// used to allow us to associate more attributes per thread
-struct thread_info {
+// used to allow us to associate more attributes per thread. Each one is
+// cache-line aligned (and so padded to whole lines) because its counters are
+// written constantly by its own worker only.
+struct CACHE_ALIGNED thread_info {
     // actual thread
     pthread_t thread_handle;
     unsigned int thread_id;
-    uint64_t num_inversions;
-    uint64_t nonce;
-    char solution_hash[41];
+    int cpu;  /* -1 when not pinned */
+
+    /* Hashes done, and seconds spent getting tasks (with --task-size=auto),
+     * over the worker's lifetime. Only the worker writes them, with plain
+     * relaxed stores (see count_hashes()); the stats thread reads them. */
+    _Atomic uint64_t num_inversions;
+    _Atomic double wait_total;
+
+    struct job *job;  /* the job being mined */
+    struct hash_buffers *buf;
+
+    /* Where buf, the logs below and a top_k heap come from */
+    struct arena arena;
+
+    /* When this worker noticed the solution and stopped */
+    double stop_time;
+
+    /* Time spent getting tasks vs. hashing them, for task size tuning */
+    double wait_time;
+    double work_time;
+    int tasks_sampled;
+
+    /* Work-stealing scheduler: picks victims */
+    uint32_t steal_seed;
+
+    /* Checkpointing only */
+    struct searched_log *searched_log;
+
+    /* Find-all mode only */
+    struct found_list found;
+
+    /* Share reporting only */
+    struct share_log *share_log;
+
+#ifdef MINE_PROFILE
+    /* Ticks charged to each phase, and the tick count at the last lap */
+    uint64_t profile[NUM_PHASES];
+    uint64_t profile_mark;
+#endif
+
+    /* Locked by thieves too, so kept off the lines above */
+    CACHE_ALIGNED struct deque deque;
 };
 
 /** Function Prototypes */
 double get_time();
 void *mine(void *arg);
-void print_binary32(uint32_t num);
-uint32_t get_difficulty(int diff);
-void print_results(struct thread_info **threads, int num_threads, double total_time);
+void *mine_queue(struct thread_info *info);
+void *mine_atomic(struct thread_info *info);
+void *mine_steal(struct thread_info *info);
+bool find_chunk(struct thread_info *info, struct chunk *chunk);
+void submit_job(struct job *job);
+void release_job(struct job *job);
+void record_solution(struct thread_info *info, uint64_t nonce,
+        const uint32_t hash[HASH_MAX_WORDS]);
+void produce_tasks(struct job *job);
+void tune_task_size(struct thread_info *info, double wait, double work);
+bool mine_range(struct thread_info *info, uint64_t start, uint64_t count);
+void range_set_add(struct range_set *set, uint64_t start, uint64_t end);
+uint64_t skip_searched(uint64_t nonce, uint64_t *limit);
+void log_searched(struct thread_info *info, uint64_t start, uint64_t end);
+void drain_searched_logs(void);
+int write_checkpoint(const struct job *job);
+int load_checkpoint(const struct job *job);
+void checkpoint_fingerprint(const struct job *job, char out[160]);
+void *checkpoint_main(void *arg);
+static void interrupt_signal(int sig);
+void report_share(struct thread_info *info, uint64_t nonce,
+        const uint32_t hash[HASH_MAX_WORDS]);
+void drain_shares(void);
+void *share_main(void *arg);
+void print_share_totals(void);
+#ifdef MINE_PROFILE
+void print_profile(void);
+#endif
+void *stats_main(void *arg);
+void stop_stats(void);
+void print_usage(const char *program);
+#ifdef MINE_OPENCL
+/* OpenCL backend, in gpu.c (included at the end of this file) */
+extern unsigned int num_gpu_devices;
+int gpu_init(const char *list);
+void gpu_start(unsigned int first_id);
+void gpu_stop(void);
+void gpu_print_rates(double total_time);
+struct thread_info *gpu_host_thread(unsigned int i);
+#endif
+void build_tail(struct thread_info *info);
+void set_nonce(struct thread_info *info, uint64_t nonce);
+void increment_nonce(struct thread_info *info);
+int scan_nonces(struct thread_info *info, uint64_t start, int count,
+        const uint32_t target[HASH_MAX_WORDS], uint32_t hash[HASH_MAX_WORDS]);
+void keep_solution(struct thread_info *info, uint64_t nonce,
+        const uint32_t hash[HASH_MAX_WORDS]);
+int compare_found(const void *a, const void *b);
+void print_found(const struct job *job, double total_time);
+int get_difficulty(const char *diff, uint32_t target[HASH_MAX_WORDS]);
+bool meets_target(const uint32_t hash[HASH_MAX_WORDS], const uint32_t target[HASH_MAX_WORDS]);
+struct job *job_create(const char *data, const uint32_t target[HASH_MAX_WORDS]);
+void job_free(struct job *job);
+double run_job(struct job *job, unsigned int num_threads);
+struct job *wait_for_job(unsigned long *generation);
+void finish_job(struct thread_info *info, uint64_t hashes);
+int run_batch(FILE *input, unsigned int num_threads);
+int run_bench(const char *data, unsigned int pool_size);
+const char *parse_job_line(char *line, uint32_t target[HASH_MAX_WORDS], char **data);
+const char *check_nonce_layout(const char *data);
+void batch_job_finished(struct job *job);
+bool print_result_line(const struct job *job, double seconds);
+int run_server(int listen_fd, const char *address);
+void server_command(int client, char *line);
+void server_job_finished(struct job *job);
+void server_report_finished(void);
+void server_wait_jobs(void);
+void server_drop_client(int client);
+void cancel_job(struct job *job);
+int run_node(int fd, const char *address);
+void node_command(char *line);
+int run_coordinator(const char *address, const char *difficulty,
+        const char *data);
+bool verify_solution(const char *data, const uint32_t target[HASH_MAX_WORDS],
+        uint64_t nonce, const char *hash);
+void print_results(const struct job *job, double total_time);
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 4) {
-        printf("Usage: %s threads difficulty 'block data (string)'\n", argv[0]);
+    static struct option long_options[] = {
+        { "scheduler", required_argument, NULL, 's' },
+        { "task-size", required_argument, NULL, 'n' },
+        { "affinity", required_argument, NULL, 'a' },
+        { "cpus", required_argument, NULL, 'c' },
+        { "batch", required_argument, NULL, 'b' },
+        { "listen", required_argument, NULL, 'l' },
+        { "coordinate", required_argument, NULL, 'C' },
+        { "join", required_argument, NULL, 'j' },
+        { "range-size", required_argument, NULL, 'r' },
+        { "checkpoint", required_argument, NULL, 'k' },
+        { "resume", no_argument, NULL, 'R' },
+        { "find-all", no_argument, NULL, 'A' },
+        { "top", required_argument, NULL, 'T' },
+        { "range", required_argument, NULL, 'N' },
+        { "share-difficulty", required_argument, NULL, 'S' },
+        { "nonce-format", required_argument, NULL, 'f' },
+        { "nonce-offset", required_argument, NULL, 'o' },
+        { "hash", required_argument, NULL, 'H' },
+        { "kernel", required_argument, NULL, 'K' },
+        { "gpu", required_argument, NULL, 'G' },
+        { "bench", required_argument, NULL, 'B' },
+        { "warmup", required_argument, NULL, 'W' },
+        { "runs", required_argument, NULL, 'P' },
+        { "stats", required_argument, NULL, 'i' },
+        { "stats-json", no_argument, NULL, 'J' },
+        { "metrics", required_argument, NULL, 'M' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    log_out = stdout;
+    FILE *batch_input = NULL;
+    const char *listen_address = NULL;
+    const char *coordinate_address = NULL;
+    const char *join_address = NULL;
+    bool resume = false;
+    const char *nonce_range = NULL;
+    const char *share_difficulty = NULL;
+    const char *hash_name = "sha1";
+    const char *kernel_name = NULL;
+    const char *gpu_list = NULL;
+    const char *metrics_address = NULL;
+    int opt;
+    char *end;
+    while ((opt = getopt_long(argc, argv, "s:n:a:c:b:l:C:j:r:k:RAT:N:S:f:o:H:K:G:B:W:P:i:JM:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            if (strcmp(optarg, "none") == 0) {
+                affinity = AFFINITY_NONE;
+            } else if (strcmp(optarg, "linear") == 0) {
+                affinity = AFFINITY_LINEAR;
+            } else if (strcmp(optarg, "cores") == 0) {
+                affinity = AFFINITY_CORES;
+            } else {
+                printf("ERROR: Unknown affinity policy '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            batch_input = strcmp(optarg, "-") == 0 ? stdin : fopen(optarg, "r");
+            if (batch_input == NULL) {
+                perror(optarg);
+                return EXIT_FAILURE;
+            }
+            show_progress = false;
+            log_out = stderr;
+            break;
+        case 'l':
+            listen_address = optarg;
+            show_progress = false;
+            log_out = stderr;
+            break;
+        case 'C':
+            coordinate_address = optarg;
+            break;
+        case 'j':
+            join_address = optarg;
+            show_progress = false;
+            log_out = stderr;
+            break;
+        case 'r':
+            range_size = strtoull(optarg, &end, 10);
+            if (*end != '\0' || range_size < 1) {
+                printf("ERROR: Invalid range size '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+            checkpoint_path = optarg;
+            break;
+        case 'R':
+            resume = true;
+            break;
+        case 'A':
+            find_all = true;
+            break;
+        case 'T':
+            top_k = strtoul(optarg, &end, 10);
+            if (*end != '\0' || top_k < 1) {
+                printf("ERROR: Invalid --top count '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            find_all = true;
+            break;
+        case 'N':
+            nonce_range = optarg;
+            break;
+        case 'S':
+            share_difficulty = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "decimal") == 0) {
+                nonce_format = NONCE_DECIMAL;
+            } else if (strcmp(optarg, "binary-le") == 0) {
+                nonce_format = NONCE_BINARY_LE;
+            } else if (strcmp(optarg, "binary-be") == 0) {
+                nonce_format = NONCE_BINARY_BE;
+            } else {
+                printf("ERROR: Unknown nonce format '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            hash_name = optarg;
+            break;
+        case 'K':
+            kernel_name = optarg;
+            break;
+        case 'B':
+            bench_nonces = strtoull(optarg, &end, 10);
+            if (*end != '\0' || optarg[0] == '-' || bench_nonces < 1) {
+                printf("ERROR: Invalid benchmark nonce count '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'W':
+            bench_warmup = strtoul(optarg, &end, 10);
+            if (*end != '\0' || optarg[0] == '-') {
+                printf("ERROR: Invalid warmup run count '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            bench_runs = strtoul(optarg, &end, 10);
+            if (*end != '\0' || optarg[0] == '-' || bench_runs < 1) {
+                printf("ERROR: Invalid run count '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            stats_interval = strtod(optarg, &end);
+            if (*end != '\0' || end == optarg || stats_interval < 0) {
+                printf("ERROR: Invalid stats interval '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'J':
+            stats_json = true;
+            break;
+        case 'M':
+            metrics_address = optarg;
+            break;
+        case 'G':
+#ifdef MINE_OPENCL
+            gpu_list = optarg;
+            break;
+#else
+            printf("ERROR: This build has no GPU support (build with "
+                    "make GPU=opencl)\n");
+            return EXIT_FAILURE;
+#endif
+        case 'o':
+            nonce_offset = strtoull(optarg, &end, 10);
+            if (*end != '\0' || optarg[0] == '-') {
+                printf("ERROR: Invalid nonce offset '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            num_affinity_cpus = parse_cpu_list(optarg, affinity_cpus, CPU_SETSIZE);
+            if (num_affinity_cpus <= 0) {
+                printf("ERROR: Invalid CPU list '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            int unavailable = unavailable_cpu(affinity_cpus, num_affinity_cpus);
+            if (unavailable >= 0) {
+                printf("ERROR: CPU %d is not available to this process\n", unavailable);
+                return EXIT_FAILURE;
+            }
+            affinity = AFFINITY_LIST;
+            break;
+        case 'n':
+            if (strcmp(optarg, "auto") == 0) {
+                task_size_auto = true;
+                break;
+            }
+            unsigned long size = strtoul(optarg, &end, 10);
+            if (*end != '\0' || size < 1 || size > MAX_NONCES_PER_TASK) {
+                printf("ERROR: Task size must be 'auto' or 1-%d\n",
+                        MAX_NONCES_PER_TASK);
+                return EXIT_FAILURE;
+            }
+            shared.nonces_per_task = size;
+            task_size_auto = false;
+            break;
+        case 's':
+            if (strcmp(optarg, "queue") == 0) {
+                scheduler = SCHED_QUEUE;
+            } else if (strcmp(optarg, "atomic") == 0) {
+                scheduler = SCHED_ATOMIC;
+            } else if (strcmp(optarg, "steal") == 0) {
+                scheduler = SCHED_STEAL;
+            } else {
+                printf("ERROR: Unknown scheduler '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            scheduler_set = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int modes = (batch_input != NULL) + (listen_address != NULL)
+        + (coordinate_address != NULL) + (join_address != NULL);
+    bool multi_job = modes > 0;
+    int positionals = coordinate_address != NULL ? 2 : multi_job ? 1 : 3;
+    if (modes > 1 || argc - optind != positionals) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    argv += optind - 1;
+
+    if (checkpoint_path != NULL && multi_job) {
+        printf("ERROR: --checkpoint only works when mining a single job\n");
+        return EXIT_FAILURE;
+    }
+    if (resume && checkpoint_path == NULL) {
+        printf("ERROR: --resume needs --checkpoint\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Find-all mode needs a range that ends, and only the work-stealing
+     * scheduler stops at the end of one */
+    uint64_t range_start = 0, range_end = UINT64_MAX;
+    if (find_all) {
+        if (multi_job || checkpoint_path != NULL) {
+            printf("ERROR: --find-all and --top only work when mining a "
+                    "single job, without --checkpoint\n");
+            return EXIT_FAILURE;
+        }
+        if (nonce_range == NULL) {
+            printf("ERROR: --find-all and --top need --range\n");
+            return EXIT_FAILURE;
+        }
+        if (scheduler_set && scheduler != SCHED_STEAL) {
+            printf("ERROR: --find-all and --top only work with the steal "
+                    "scheduler\n");
+            return EXIT_FAILURE;
+        }
+        scheduler = SCHED_STEAL;
+    }
+    if (nonce_range != NULL) {
+        if (!find_all) {
+            printf("ERROR: --range needs --find-all or --top\n");
+            return EXIT_FAILURE;
+        }
+        unsigned long long first, last;
+        char extra;
+        if (sscanf(nonce_range, "%llu-%llu%c", &first, &last, &extra) != 2
+                || first > last || last == UINT64_MAX) {
+            printf("ERROR: Invalid nonce range '%s'\n", nonce_range);
+            return EXIT_FAILURE;
+        }
+        range_start = first;
+        range_end = last + 1;
+    }
+
+    if (nonce_offset != SIZE_MAX && nonce_format == NONCE_DECIMAL) {
+        printf("ERROR: --nonce-offset needs a binary --nonce-format\n");
+        return EXIT_FAILURE;
+    }
+    if (nonce_format != NONCE_DECIMAL
+            && (coordinate_address != NULL || join_address != NULL)) {
+        printf("ERROR: --coordinate and --join only use decimal nonces\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Targets depend on the engine's digest size, so this comes first */
+    int selected = hash_select_engine(hash_name, kernel_name, &engine);
+    if (selected == -1) {
+        printf("ERROR: Unknown hash '%s'\n", hash_name);
+        return EXIT_FAILURE;
+    }
+    if (selected != 0) {
+        printf("ERROR: No %s kernel '%s' on this CPU\n", hash_name, kernel_name);
+        return EXIT_FAILURE;
+    }
+
+    if (share_difficulty != NULL) {
+        if (multi_job || find_all) {
+            printf("ERROR: --share-difficulty only works when mining a "
+                    "single job, without --find-all\n");
+            return EXIT_FAILURE;
+        }
+        if (get_difficulty(share_difficulty, share_target) != 0) {
+            printf("ERROR: Invalid share difficulty '%s'\n", share_difficulty);
+            return EXIT_FAILURE;
+        }
+        shares_on = true;
+        show_progress = false;
+    }
+
+    if (strcmp(engine.name, "sha1") != 0
+            && (coordinate_address != NULL || join_address != NULL)) {
+        printf("ERROR: --coordinate and --join only use SHA-1\n");
         return EXIT_FAILURE;
     }
 
-    difficulty_mask = get_difficulty(atoi(argv[2]));
+    if (bench_nonces > 0) {
+        if (multi_job || find_all || checkpoint_path != NULL || shares_on) {
+            printf("ERROR: --bench only works with a single job, without "
+                    "--find-all,\n       --checkpoint or --share-difficulty\n");
+            return EXIT_FAILURE;
+        }
+        show_progress = false;
+    }
+
+    /* GPUs claim nonces like atomic-scheduler workers and only run SHA-1 */
+    if (gpu_list != NULL) {
+        if (multi_job || find_all || checkpoint_path != NULL || shares_on) {
+            printf("ERROR: --gpu only works when mining a single job, without "
+                    "--find-all,\n       --checkpoint or --share-difficulty\n");
+            return EXIT_FAILURE;
+        }
+        if (scheduler_set && scheduler != SCHED_ATOMIC) {
+            printf("ERROR: --gpu only works with the atomic scheduler\n");
+            return EXIT_FAILURE;
+        }
+        if (strcmp(engine.name, "sha1") != 0) {
+            printf("ERROR: --gpu only uses SHA-1\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* The coordinator only hands out work, so it needs no workers */
+    if (coordinate_address != NULL)
+        return run_coordinator(coordinate_address, argv[1], argv[2]);
+
+    /* Batch jobs only run side by side under the work-stealing scheduler,
+     * and the daemon always needs it */
+    if (batch_input != NULL && !scheduler_set)
+        scheduler = SCHED_STEAL;
+    if (listen_address != NULL || join_address != NULL) {
+        if (scheduler_set && scheduler != SCHED_STEAL) {
+            printf("ERROR: --listen and --join only work with the steal "
+                    "scheduler\n");
+            return EXIT_FAILURE;
+        }
+        scheduler = SCHED_STEAL;
+    }
+
+    int listen_fd = -1;
+    if (listen_address != NULL) {
+        errno = 0;
+        listen_fd = net_listen(listen_address);
+        if (listen_fd < 0) {
+            printf("ERROR: Could not listen on '%s': %s\n", listen_address,
+                    errno ? strerror(errno) : "bad address");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (metrics_address != NULL) {
+        errno = 0;
+        metrics_fd = net_listen(metrics_address);
+        if (metrics_fd < 0) {
+            printf("ERROR: Could not listen on '%s': %s\n", metrics_address,
+                    errno ? strerror(errno) : "bad address");
+            return EXIT_FAILURE;
+        }
+    }
+    if (stats_interval < 0)
+        stats_interval = show_progress ? STATS_DEFAULT_SECONDS : 0;
+
+    int coordinator_fd = -1;
+    if (join_address != NULL) {
+        errno = 0;
+        coordinator_fd = net_connect(join_address);
+        if (coordinator_fd < 0) {
+            printf("ERROR: Could not connect to '%s': %s\n", join_address,
+                    errno ? strerror(errno) : "bad address");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct job *job = NULL;
+    if (!multi_job) {
+        uint32_t target[HASH_MAX_WORDS];
+        if (get_difficulty(argv[2], target) != 0) {
+            printf("ERROR: Invalid difficulty '%s'\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+
+        char target_hex[8 * HASH_MAX_WORDS + 1];
+        hash_tostring(target_hex, target, engine.words);
+        printf("\nTarget: %s\n", target_hex);
+
+        /* Check to make sure the user entered a valid (non-empty) string */
+        if(strcmp(argv[3], "") == 0){
+          printf("ERROR: The string passed as the block data is empty.\n");
+          return EXIT_FAILURE;
+        }
+        const char *layout_error = check_nonce_layout(argv[3]);
+        if (layout_error != NULL) {
+            printf("ERROR: Can't place the nonce: %s\n", layout_error);
+            return EXIT_FAILURE;
+        }
+
+        if (shares_on && !meets_target(target, share_target)) {
+            printf("ERROR: The share difficulty must be below the block "
+                    "difficulty\n");
+            return EXIT_FAILURE;
+        }
 
-    printf("\nDifficulty Mask: ");
-    print_binary32(difficulty_mask);
-    printf("\n");
+        job = job_create(argv[3], target);
+        job->range_start = range_start;
+        job->range_end = range_end;
 
-    bitcoin_block_data = argv[3];
+        if (resume) {
+            int loaded = load_checkpoint(job);
+            if (loaded < 0) {
+                printf("ERROR: '%s' is not a checkpoint of this job\n",
+                        checkpoint_path);
+                return EXIT_FAILURE;
+            }
+            if (loaded == 0) {
+                uint64_t done = 0;
+                size_t r;
+                for (r = 0; r < resume_searched.count; r++)
+                    done += resume_searched.ranges[r].end - resume_searched.ranges[r].start;
+                printf("Resuming: %llu nonces already searched\n",
+                        (unsigned long long) done);
 
-    /* Check to make sure the user entered a valid (non-empty) string */
-    if(strcmp(bitcoin_block_data, "") == 0){
-      printf("ERROR: The string passed as the block data is empty.\n");
-      return EXIT_FAILURE;
+                /* Start past the searched prefix rather than skipping it
+                 * a task at a time */
+                if (resume_searched.count > 0 && resume_searched.ranges[0].start == 0)
+                    job->range_start = resume_searched.ranges[0].end;
+            }
+        }
+        if (checkpoint_path != NULL) {
+            size_t r;
+            for (r = 0; r < resume_searched.count; r++)
+                range_set_add(&searched, resume_searched.ranges[r].start,
+                        resume_searched.ranges[r].end);
+        }
     }
 
+    fprintf(log_out, "%s backend: %s (%d lane%s)\n", engine.name,
+            engine.kernel, engine.lanes, engine.lanes == 1 ? "" : "s");
+
+    /* With GPUs mining, the CPU workers are optional */
     unsigned int num_threads = 5;
-    if(atoi(argv[1]) < 1)
-      printf("ERROR: Invalid number of threads, defaulting to 5\n");
+    if (gpu_list != NULL && strcmp(argv[1], "0") == 0)
+      num_threads = 0;
+    else if(atoi(argv[1]) < 1)
+      fprintf(log_out, "ERROR: Invalid number of threads, defaulting to 5\n");
     else
       num_threads = atoi(argv[1]);
 
-    struct thread_info *threads[num_threads];
+    unsigned int pool_size = num_threads;
+#ifdef MINE_OPENCL
+    if (gpu_list != NULL) {
+        if (gpu_init(gpu_list) < 0)
+            return EXIT_FAILURE;
+        pool_size += num_gpu_devices;
+    }
+#endif
+
+    if (affinity == AFFINITY_LINEAR || affinity == AFFINITY_CORES) {
+        num_affinity_cpus = cpu_order(affinity, affinity_cpus, CPU_SETSIZE);
+        if (num_affinity_cpus <= 0) {
+            fprintf(log_out, "ERROR: Could not read the CPU topology, not pinning threads\n");
+            affinity = AFFINITY_NONE;
+        }
+    }
+
+    /* Every thread_info is set up before any worker starts, since workers
+     * steal from each other's deques */
+    struct thread_info *threads[num_threads > 0 ? num_threads : 1];
+    size_t arena_size = sizeof(struct hash_buffers) + 4 * CACHE_LINE;
+    if (checkpoint_path != NULL)
+        arena_size += sizeof(struct searched_log);
+    if (shares_on)
+        arena_size += sizeof(struct share_log);
+    arena_size += sizeof(struct found) * top_k;
     int i;
     for(i = 0; i < num_threads; i++){
-      threads[i] = calloc(1, sizeof(struct thread_info));
+      threads[i] = aligned_alloc(CACHE_LINE, sizeof(struct thread_info));
+      memset(threads[i], 0, sizeof(struct thread_info));
       threads[i]->thread_id = i;
-      pthread_create(&(threads[i]->thread_handle), NULL, mine, threads[i]);
-    }
+      threads[i]->cpu = -1;
+      threads[i]->steal_seed = i * 2654435761u + 1;
+      pthread_mutex_init(&threads[i]->deque.lock, NULL);
 
-    double start_time = get_time();
+      /* Everything a worker keeps for the whole run comes from its arena.
+       * Fresh mappings read as zeros and are not written here, so the
+       * pages stay untouched until the worker itself uses them. */
+      struct arena *arena = &threads[i]->arena;
+      if (arena_init(arena, arena_size) < 0) {
+          perror("mmap");
+          return EXIT_FAILURE;
+      }
+      if (checkpoint_path != NULL)
+          threads[i]->searched_log = arena_alloc(arena, sizeof(struct searched_log));
+      if (shares_on)
+          threads[i]->share_log = arena_alloc(arena, sizeof(struct share_log));
+      if (top_k > 0) {
+          /* The heap never holds more than top_k, so it never grows */
+          threads[i]->found.items = arena_alloc(arena, sizeof(struct found) * top_k);
+          threads[i]->found.capacity = top_k;
+      }
+    }
+    if (num_threads > 0)
+        fprintf(log_out, "Worker arenas: %zu KB each, on %s\n",
+                threads[0]->arena.size / 1024,
+                arena_backing_name(threads[0]->arena.backing));
+    workers = threads;
+    num_workers = num_threads;
 
-    uint64_t current_nonce = 0;
-    while (current_nonce < UINT64_MAX) {
+    if (affinity != AFFINITY_NONE)
+        fprintf(log_out, "CPU affinity:");
+    for(i = 0; i < num_threads; i++){
 
-        uint64_t *nonces = malloc(sizeof(uint64_t) * NONCES_PER_TASK);
-        int i;
-        for (i = 0; i < NONCES_PER_TASK; ++i) {
-            nonces[i] = current_nonce++; //initializes nonces and increments current_nonce after
+      /* Pin the thread before it starts, so even its first allocations
+       * happen on the right node. With more threads than CPUs the list
+       * wraps around. */
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      if (affinity != AFFINITY_NONE) {
+          cpu_set_t set;
+          CPU_ZERO(&set);
+          threads[i]->cpu = affinity_cpus[i % num_affinity_cpus];
+          CPU_SET(threads[i]->cpu, &set);
+          if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0) {
+              printf("\nERROR: Could not pin thread %d to CPU %d\n", i, threads[i]->cpu);
+              return EXIT_FAILURE;
+          }
+          fprintf(log_out, " %d", threads[i]->cpu);
+      }
+      if (pthread_create(&(threads[i]->thread_handle), &attr, mine, threads[i]) != 0) {
+          printf("\nERROR: Could not start thread %d\n", i);
+          return EXIT_FAILURE;
+      }
+      pthread_attr_destroy(&attr);
+    }
+    if (affinity != AFFINITY_NONE)
+        fprintf(log_out, "\n");
+#ifdef MINE_OPENCL
+    gpu_start(num_threads);
+#endif
+    if (stats_interval > 0 || metrics_fd >= 0) {
+        pthread_create(&stats_thread, NULL, stats_main, NULL);
+        stats_running = true;
+    }
 
-            if (current_nonce % 1000000 == 0) {
-                /* Print out '.' to show progress every 1m hashes: */
-                printf(".");
-                fflush(stdout);
-            }
+    int status = 0;
+    if (listen_address != NULL) {
+        status = run_server(listen_fd, listen_address);
+    } else if (join_address != NULL) {
+        status = run_node(coordinator_fd, join_address);
+    } else if (batch_input != NULL) {
+        status = run_batch(batch_input, num_threads);
+        if (batch_input != stdin)
+            fclose(batch_input);
+    } else if (bench_nonces > 0) {
+        status = run_bench(job->data, pool_size);
+        job_free(job);
+    } else {
+        /* On SIGINT/SIGTERM stop mining, and save what was searched or
+         * print what was found */
+        if (checkpoint_path != NULL || find_all) {
+            interrupt_job = job;
+            struct sigaction action = { 0 };
+            action.sa_handler = interrupt_signal;
+            sigaction(SIGINT, &action, NULL);
+            sigaction(SIGTERM, &action, NULL);
         }
 
-        /* Nonces are ready to be consumed. Will wait for a consumer thread
-         * to pick up the job. */
-        pthread_mutex_lock(&task_mutex);
-        while (task_pointer != NULL && solution_found == false)
-            pthread_cond_wait(&task_staging, &task_mutex);
-
-        if (solution_found == true)
-            break;
+        pthread_t checkpoint_thread, share_thread;
+        if (checkpoint_path != NULL)
+            pthread_create(&checkpoint_thread, NULL, checkpoint_main, job);
+        if (shares_on)
+            pthread_create(&share_thread, NULL, share_main, NULL);
+        double total_time = run_job(job, pool_size);
+        stop_stats();
+        if (checkpoint_path != NULL) {
+            atomic_store(&checkpoint_done, true);
+            pthread_join(checkpoint_thread, NULL);
+        }
+        if (shares_on) {
+            atomic_store(&shares_done, true);
+            pthread_join(share_thread, NULL);
+        }
 
-        /* We have acquired a mutex on task_mutex. We can now update the pointer
-         * to point to the new task we just generated */
-        task_pointer = nonces;
+        if (find_all) {
+            print_found(job, total_time);
+        } else if (job->solver >= 0) {
+            print_results(job, total_time);
+            if (shares_on)
+                print_share_totals();
+        } else {
+            printf("Interrupted; progress saved to %s\n", checkpoint_path);
+            status = EXIT_FAILURE;
+        }
+        job_free(job);
+    }
 
-        /* Tell the consumer a new task is ready */
-        pthread_cond_signal(&task_ready);
+    /* Let the workers go and wait for them to exit */
+    stop_stats();
+    pthread_mutex_lock(&pool_mutex);
+    pool_shutdown = true;
+    pthread_cond_broadcast(&job_posted);
+    pthread_cond_broadcast(&work_available);
+    pthread_mutex_unlock(&pool_mutex);
+    for(i = 0; i < num_threads; i++)
+      pthread_join(threads[i]->thread_handle, NULL);
+#ifdef MINE_OPENCL
+    gpu_stop();
+#endif
 
-        /* Let a consumer have the mutex to get the task */
-        pthread_mutex_unlock(&task_mutex);
-    } //while current_nonce < UINT64_MAX
+    for(i = 0; i < num_threads; i++){
+      pthread_mutex_destroy(&threads[i]->deque.lock);
+      free(threads[i]->deque.chunks);
+      if (top_k == 0)
+          free(threads[i]->found.items);
+      arena_destroy(&threads[i]->arena);
+      free(threads[i]);
+    }
 
-    printf("\n");
+    return status;
+}
 
-    /* If we reach this point, one of the threads found a solution. We will
-     * signal any waiting worker threads so they will wake up and see
-     * that solution_found is true */
-    pthread_cond_broadcast(&task_ready);
+/* Function: print_usage
+ * ---------------------
+ * Prints the command line syntax.
+ */
+void print_usage(const char *program) {
+    printf("Usage: %s [options] threads difficulty 'block data (string)'\n", program);
+    printf("       %s [options] --batch=FILE threads\n", program);
+    printf("       %s [options] --listen=ADDRESS threads\n", program);
+    printf("       %s [options] --join=ADDRESS threads\n", program);
+    printf("       %s --coordinate=ADDRESS [--range-size=N] difficulty "
+            "'block data'\n", program);
+    printf("  difficulty: leading zero bits (0-160, or 0-256 for sha256d), "
+            "or compact target\n");
+    printf("              bits such as 0x1300ffff\n");
+    printf("Options:\n");
+    printf("  -s, --scheduler=atomic|queue|steal\n");
+    printf("                                how workers get nonces: claim "
+            "ranges with an\n");
+    printf("                                atomic counter (default), take "
+            "tasks from a\n");
+    printf("                                producer thread, or steal ranges "
+            "from each\n");
+    printf("                                other's deques (default with "
+            "--batch, the only\n");
+    printf("                                one that runs batch jobs "
+            "concurrently)\n");
+    printf("  -n, --task-size=N|auto        nonces per task, or grow it at "
+            "runtime until\n");
+    printf("                                claiming tasks costs under "
+            "%.0f%% (default: auto)\n", TASK_OVERHEAD_TARGET * 100);
+    printf("  -a, --affinity=none|linear|cores\n");
+    printf("                                pin workers to CPUs in numeric "
+            "order, or one per\n");
+    printf("                                physical core before SMT "
+            "siblings (default: none)\n");
+    printf("  -c, --cpus=LIST               pin worker i to the i-th CPU of "
+            "LIST, e.g. 0,2,4-7\n");
+    printf("  -b, --batch=FILE              mine every 'difficulty block data' "
+            "line of FILE\n");
+    printf("                                (- for stdin) and print 'line nonce "
+            "hash hashes\n");
+    printf("                                seconds' for each as it "
+            "finishes\n");
+    printf("  -l, --listen=ADDRESS          run as a daemon taking jobs on "
+            "unix:PATH or\n");
+    printf("                                tcp:[HOST:]PORT (commands: "
+            "SUBMIT difficulty data,\n");
+    printf("                                REPLACE difficulty data, "
+            "CANCEL id)\n");
+    printf("  -C, --coordinate=ADDRESS      split one job between the "
+            "nodes that --join\n");
+    printf("                                ADDRESS, without hashing "
+            "anything here\n");
+    printf("  -r, --range-size=N            nonces per range handed to a "
+            "node (default: %llu)\n", DEFAULT_RANGE_SIZE);
+    printf("  -j, --join=ADDRESS            mine ranges for the coordinator "
+            "at ADDRESS\n");
+    printf("  -k, --checkpoint=FILE         save the nonce ranges searched so "
+            "far to FILE every\n");
+    printf("                                %.0f seconds and when interrupted "
+            "(single job only)\n", CHECKPOINT_SECONDS);
+    printf("  -R, --resume                  skip the ranges already searched "
+            "according to the\n");
+    printf("                                --checkpoint file\n");
+    printf("  -A, --find-all                hash every nonce in --range and "
+            "print every\n");
+    printf("                                solution instead of stopping at "
+            "the first\n");
+    printf("  -T, --top=K                   like --find-all, but print only "
+            "the K best\n");
+    printf("                                solutions (most leading zeros)\n");
+    printf("  -N, --range=FIRST-LAST        nonces to search with --find-all "
+            "or --top\n");
+    printf("  -H, --hash=sha1|sha256d       proof-of-work hash (default: "
+            "sha1)\n");
+    printf("  -K, --kernel=NAME|auto        hash with this kernel, e.g. "
+            "portable, sse2, avx2,\n");
+    printf("                                avx512, neon or sha-ni, instead "
+            "of the fastest\n");
+    printf("                                (default: auto)\n");
+    printf("  -f, --nonce-format=decimal|binary-le|binary-be\n");
+    printf("                                append the nonce as decimal "
+            "digits (default), or\n");
+    printf("                                insert it as an 8-byte little- or "
+            "big-endian\n");
+    printf("                                integer\n");
+    printf("  -o, --nonce-offset=N          put a binary nonce at byte N of "
+            "the block data\n");
+    printf("                                (default: at the end)\n");
+    printf("  -G, --gpu=all|LIST            also mine on these OpenCL GPUs, "
+            "e.g. 0,1 (needs a\n");
+    printf("                                make GPU=opencl build; threads "
+            "may then be 0)\n");
+    printf("  -B, --bench=NONCES            hash nonces 0 to NONCES-1 per run, "
+            "ignoring the\n");
+    printf("                                difficulty, and report the hash "
+            "rate of each run\n");
+    printf("  -W, --warmup=N                unmeasured runs before the "
+            "benchmark (default: 1)\n");
+    printf("  -P, --runs=N                  measured benchmark runs (default: "
+            "5)\n");
+    printf("  -i, --stats=SECONDS           print the hash rate, per thread "
+            "too, every SECONDS\n");
+    printf("                                (default: %.0f for a single job, "
+            "otherwise 0 = off)\n", STATS_DEFAULT_SECONDS);
+    printf("  -J, --stats-json              print the stats as JSON lines\n");
+    printf("  -M, --metrics=ADDRESS         serve the counters to Prometheus "
+            "over HTTP on\n");
+    printf("                                tcp:[HOST:]PORT or unix:PATH\n");
+    printf("  -S, --share-difficulty=D      also print a 'share thread nonce "
+            "hash' line for\n");
+    printf("                                every hash meeting the easier "
+            "difficulty D\n");
+}
 
-    /* Since the loop will break before unlocking the task_mutex
-     * we have to call it here */
-    pthread_mutex_unlock(&task_mutex);
+/* Function: queue_solved
+ * ----------------------
+ * returns: true once the queue scheduler's producer can stop (arg is the
+ *          job)
+ */
+static bool queue_solved(void *arg) {
+    struct job *job = arg;
+    return job->solution_found;
+}
 
-    double end_time = get_time();
+/* Function: queue_done
+ * --------------------
+ * returns: true once no more tasks of the job (arg) will be queued
+ */
+static bool queue_done(void *arg) {
+    struct job *job = arg;
+    return job->solution_found || job->exhausted;
+}
 
-    /* Tell all of the threads to stop */
-    for(i = 0; i < num_threads; i++)
-      pthread_join(threads[i]->thread_handle, NULL);
+/* Function: produce_tasks
+ * -----------------------
+ * Producer side of the queue scheduler: queues tasks of nonces_per_task
+ * nonces on shared.tasks until a solution to job is found or its range
+ * runs out. Tasks are just a start and a count, and the ring holds
+ * TASK_RING_SIZE of them, so the producer runs well ahead of the workers
+ * and only sleeps while the ring is full.
+ *
+ * job: job being mined; its last_stop is set when the producer stops
+ */
+void produce_tasks(struct job *job) {
+    uint64_t current_nonce = job->range_start;
+    while (!job->solution_found && current_nonce < job->range_end) {
+        uint32_t count = shared.nonces_per_task;
+        if (count > job->range_end - current_nonce)
+            count = job->range_end - current_nonce;
+        if (!task_ring_push(&shared.tasks, current_nonce, count)) {
+            task_ring_park(&shared.tasks, false, queue_solved, job);
+            continue;
+        }
+        current_nonce += count;
+    }
 
-    print_results(threads, num_threads, end_time - start_time);
+    /* Workers that find the ring empty from now on stop, instead of going
+     * back to sleep */
+    atomic_store(&job->exhausted, true);
+    task_ring_wake_all(&shared.tasks);
 
-    return 0;
+    double now = get_time();
+    pthread_mutex_lock(&pool_mutex);
+    if (now > job->last_stop)
+        job->last_stop = now;
+    pthread_mutex_unlock(&pool_mutex);
 }
 
 /*
- * retrieves the current system time (in seconds).
+ * retrieves the time (in seconds) from the monotonic clock, which is only
+ * good for measuring intervals but never jumps when the system time is set.
  */
 double get_time() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec + tv.tv_usec / 1000000.0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
 }
 
-/* Function: print_binary32
+/* Function: get_difficulty
  * ------------------------
- * prints a 32 bit number in binary using bit manipulation
+ * Builds the engine's target (160 bits for SHA-1, 256 for SHA-256d) from
+ * the difficulty argument, which is either a number of leading zero bits
+ * or, when it starts with 0x, a Bitcoin-style compact target: the low three
+ * bytes are a mantissa and the high byte is the length of the target in
+ * bytes, so 0x1300ffff means 0x00ffff * 256^16.
  *
- * num: 32 bit int to print
+ * diff: difficulty argument
+ * target: receives the target as big-endian words
+ *
+ * returns: 0 on success, -1 if the difficulty is malformed or out of range
 */
-void print_binary32(uint32_t num) {
-    int i;
-    for (i = 31; i >= 0; --i) {
-        uint32_t position = 1 << i;
-        printf("%c", ((num & position) == position) ? '1' : '0');
+int get_difficulty(const char *diff, uint32_t target[HASH_MAX_WORDS]){
+  char *end;
+  int i;
+
+  if(strncmp(diff, "0x", 2) == 0 || strncmp(diff, "0X", 2) == 0){
+    unsigned long bits = strtoul(diff + 2, &end, 16);
+    if(*end != '\0' || end == diff + 2 || bits > 0xFFFFFFFFUL || (bits & 0x00800000))
+      return -1;
+
+    int exponent = bits >> 24;
+    uint32_t mantissa = bits & 0x007FFFFF;
+    int size = 4 * engine.words;
+    uint8_t bytes[4 * HASH_MAX_WORDS] = { 0 };
+
+    /* Mantissa byte i (most significant first) lands exponent - 1 - i bytes
+     * above the least significant byte of the target */
+    for(i = 0; i < 3; i++){
+      uint8_t byte = mantissa >> (8 * (2 - i));
+      int position = exponent - 1 - i;
+      if(position < 0)
+        continue;
+      if(position >= size){
+        if(byte != 0)
+          return -1; /* does not fit in a hash */
+        continue;
+      }
+      bytes[size - 1 - position] = byte;
+    }
+
+    for(i = 0; i < engine.words; i++){
+      target[i] = (uint32_t) bytes[4 * i] << 24 | bytes[4 * i + 1] << 16
+        | bytes[4 * i + 2] << 8 | bytes[4 * i + 3];
     }
+    return 0;
+  }
+
+  long zeros = strtol(diff, &end, 10);
+  if(*end != '\0' || end == diff || zeros < 0 || zeros > 32 * engine.words)
+    return -1;
+
+  for(i = 0; i < engine.words; i++){
+    long word_zeros = zeros - 32 * i;
+    if(word_zeros <= 0)
+      target[i] = 0xFFFFFFFF;
+    else if(word_zeros >= 32)
+      target[i] = 0;
+    else
+      target[i] = 0xFFFFFFFF >> word_zeros;
+  }
+  return 0;
 }
 
-/* Function: get_difficulty
- * ------------------------
- * Returns the number of bits based off int
+/* Function: meets_target
+ * ----------------------
+ * Compares a full hash against a target, most significant word first,
+ * stopping at the first word that differs.
  *
- * diff: int used to set mask
+ * hash: hash state words (word 0 is the front of the digest)
+ * target: target words, in the same order
  *
- * returns: 32 bit mask with diff amount of leading zeros
+ * returns: true if hash <= target
 */
-uint32_t get_difficulty(int diff){
-  uint32_t mask = 0;
-
+bool meets_target(const uint32_t hash[HASH_MAX_WORDS], const uint32_t target[HASH_MAX_WORDS]){
   int i;
-  for(i = 0; i < 32 - diff; i++){
-    uint32_t position = 1 << i;
-    mask = mask | position;
+  for(i = 0; i < engine.words; i++){
+    if(hash[i] != target[i])
+      return hash[i] < target[i];
   }
+  return true;
+}
 
-  return mask;
+/* Function: put_tail_byte
+ * -----------------------
+ * Stores one byte of the tail message into its big-endian word.
+ */
+static inline void put_tail_byte(uint32_t *words, size_t pos, uint8_t c) {
+    int shift = 8 * (3 - (pos & 3));
+    words[pos >> 2] = (words[pos >> 2] & ~(0xFFu << shift))
+        | ((uint32_t) c << shift);
+}
+
+/* Function: put_digit
+ * -------------------
+ * Rewrites one nonce digit in both the message and the padded tail words.
+ */
+static inline void put_digit(struct thread_info *info, size_t i, char c) {
+    info->buf->message[info->job->nonce_pos + i] = c;
+    put_tail_byte(info->buf->tail_words, info->job->nonce_pos + i, c);
+}
+
+/* Function: load_message
+ * ----------------------
+ * Copies info->job's tail into the thread's message, leaving a gap for a
+ * binary nonce at nonce_pos. The tail never changes during a job, so this
+ * is done once per job rather than per nonce.
+ */
+static inline void load_message(struct thread_info *info) {
+    const struct job *job = info->job;
+    memcpy(info->buf->message, job->tail, job->nonce_pos);
+    memcpy(info->buf->message + job->nonce_pos + NONCE_BYTES,
+            job->tail + job->nonce_pos, job->tail_len - job->nonce_pos);
+}
+
+/* Function: build_tail
+ * --------------------
+ * Lays out the padded final block(s) for the current message: block tail
+ * and nonce, the 0x80 terminator, zeros and the 64-bit message length.
+ * The result is one block when the message leaves room for the length
+ * (55 bytes or less) and two blocks otherwise.
+ *
+ * info: thread whose tail_words are rebuilt
+ */
+void build_tail(struct thread_info *info) {
+    size_t len = info->job->tail_len + info->buf->num_digits;
+    info->buf->tail_blocks = (len > 55) ? 2 : 1;
+    memset(info->buf->tail_words, 0, sizeof(info->buf->tail_words));
+
+    size_t i;
+    for (i = 0; i < len; i++)
+        put_tail_byte(info->buf->tail_words, i, info->buf->message[i]);
+    put_tail_byte(info->buf->tail_words, len, 0x80);
+
+    uint64_t bits = (info->job->absorbed + len) * 8;
+    uint32_t *last = info->buf->tail_words + 16 * (info->buf->tail_blocks - 1);
+    last[14] = bits >> 32;
+    last[15] = (uint32_t) bits;
+}
+
+/* Function: set_nonce
+ * -------------------
+ * Writes nonce into the thread's message buffer, as decimal digits after
+ * the block tail or in binary at nonce_pos.
+ *
+ * info: thread whose message is updated
+ * nonce: value to write
+ */
+void set_nonce(struct thread_info *info, uint64_t nonce) {
+    if (nonce_format != NONCE_DECIMAL) {
+        char *bytes = info->buf->message + info->job->nonce_pos;
+        int i;
+        for (i = 0; i < NONCE_BYTES; i++) {
+            int shift = 8 * (nonce_format == NONCE_BINARY_LE ? i : NONCE_BYTES - 1 - i);
+            bytes[i] = nonce >> shift;
+        }
+        info->buf->num_digits = NONCE_BYTES;
+        build_tail(info);
+        return;
+    }
+
+    char buf[20];
+    size_t len = 0;
+    do {
+        buf[len++] = '0' + nonce % 10;
+        nonce /= 10;
+    } while (nonce > 0);
+
+    char *digits = info->buf->message + info->job->nonce_pos;
+    size_t i;
+    for (i = 0; i < len; i++)
+        digits[i] = buf[len - 1 - i];
+    info->buf->num_digits = len;
+    build_tail(info);
+}
+
+/* Function: increment_nonce
+ * -------------------------
+ * Adds one to the nonce in the thread's message buffer like an odometer:
+ * only the trailing digits that roll over are rewritten, and the number
+ * grows by a digit when every digit was a 9. Binary nonces carry from the
+ * least significant byte the same way, but never change length.
+ *
+ * info: thread whose message is updated
+ */
+void increment_nonce(struct thread_info *info) {
+    if (nonce_format != NONCE_DECIMAL) {
+        const uint8_t *bytes = (const uint8_t *) info->buf->message + info->job->nonce_pos;
+        int i;
+        for (i = 0; i < NONCE_BYTES; i++) {
+            int pos = nonce_format == NONCE_BINARY_LE ? i : NONCE_BYTES - 1 - i;
+            uint8_t byte = bytes[pos] + 1;
+            put_digit(info, pos, byte);
+            if (byte != 0)
+                break;
+        }
+        return;
+    }
+
+    char *digits = info->buf->message + info->job->nonce_pos;
+    size_t i = info->buf->num_digits;
+    while (i > 0 && digits[i - 1] == '9') {
+        --i;
+        put_digit(info, i, '0');
+    }
+
+    if (i > 0) {
+        put_digit(info, i - 1, digits[i - 1] + 1);
+    } else {
+        /* The message grew by a byte, so the padding and length move */
+        digits[0] = '1';
+        digits[info->buf->num_digits++] = '0';
+        build_tail(info);
+    }
+}
+
+/* Function: hash_tail
+ * -------------------
+ * Hashes the thread's current message one nonce at a time, starting from
+ * the job's midstate.
+ */
+static inline void hash_tail(struct thread_info *info, uint32_t hash[HASH_MAX_WORDS]) {
+    engine.hash(info->job->midstate, info->buf->tail_words,
+            info->buf->tail_blocks, hash);
+}
+
+/* Function: hash_front
+ * --------------------
+ * Like hash_tail, but only works out the front 32 bits of the hash, which is
+ * all the difficulty test needs.
+ */
+static inline uint32_t hash_front(struct thread_info *info) {
+    return engine.front(info->job->midstate, info->buf->tail_words,
+            info->buf->tail_blocks);
+}
+
+/* Function: count_hashes
+ * ----------------------
+ * Adds to a worker's hash count. Only the worker itself writes the count,
+ * so a relaxed load and store are enough and no locked add is needed.
+ */
+static inline void count_hashes(struct thread_info *info, uint64_t n) {
+    atomic_store_explicit(&info->num_inversions,
+            atomic_load_explicit(&info->num_inversions, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+/* Function: varying_words
+ * -----------------------
+ * Finds the tail words that can change anywhere between nonces first and
+ * last, which must have the same number of digits. Counting up from first
+ * to last passes through every value of the digits after the longest
+ * prefix the two ends share, so those digits up to the last one all vary
+ * even where the two ends happen to agree. A binary nonce likewise varies
+ * from its least significant byte up to the most significant byte in
+ * which the ends differ. Only the words outside that span stay the same.
+ *
+ * info: thread whose message buffer is left holding nonce first
+ * lo, hi: set to the first and last word that can vary; both are the word
+ *         of the nonce's lowest-order byte when first == last
+ */
+static void varying_words(struct thread_info *info, uint64_t first, uint64_t last,
+        int *lo, int *hi) {
+    set_nonce(info, first);
+    size_t pos = info->job->nonce_pos, from, to;
+
+    if (nonce_format == NONCE_DECIMAL) {
+        const char *digits = info->buf->message + pos;
+        size_t len = info->buf->num_digits;
+        char last_digits[20];
+        size_t i = len;
+        do {
+            last_digits[--i] = '0' + last % 10;
+            last /= 10;
+        } while (i > 0);
+
+        size_t shared = 0;
+        while (shared < len - 1 && digits[shared] == last_digits[shared])
+            shared++;
+        from = pos + shared;
+        to = pos + len - 1;
+    } else {
+        uint64_t diff = first ^ last;
+        int top = diff == 0 ? 0 : (63 - __builtin_clzll(diff)) / 8;
+        if (nonce_format == NONCE_BINARY_LE) {
+            from = pos;
+            to = pos + top;
+        } else {
+            from = pos + NONCE_BYTES - 1 - top;
+            to = pos + NONCE_BYTES - 1;
+        }
+    }
+    *lo = from / 4;
+    *hi = to / 4;
+}
+
+/* Function: scan_nonces
+ * ---------------------
+ * Hashes count consecutive nonces beginning at start and looks for one that
+ * meets target. Only the front word is computed for every nonce;
+ * a hash whose front word is at most target[0] is then hashed in
+ * full and compared word by word. Nonces are fed to the vector
+ * kernel in groups of engine.lanes, and a short final group is hashed one
+ * at a time. A range that gains a digit part way is split there, so that
+ * every tail in a scan has the same layout.
+ *
+ * Only the tail words that change within the range are copied into the
+ * lanes for each group; the rest are filled in once. Where the engine can,
+ * the blocks and leading rounds over those constant words are also worked
+ * out once per range instead of once per nonce (see sha1_scan_prefix()).
+ *
+ * info: thread doing the work on info->job; its message buffer is overwritten
+ * start: first nonce
+ * count: number of nonces to try
+ * target: usually info->job->target
+ * hash: receives the full hash state of the solution, if any
+ *
+ * Gives up early once solution_found is set, checking at least every
+ * STOP_CHECK_INTERVAL nonces. The nonces tried, up to and including the
+ * solution, are added to info->num_inversions.
+ *
+ * returns: offset of the solution from start, or -1 if none was found
+ */
+int scan_nonces(struct thread_info *info, uint64_t start, int count,
+        const uint32_t target[HASH_MAX_WORDS], uint32_t hash[HASH_MAX_WORDS]) {
+    int lanes = engine.lanes;
+    PROFILE_LAP(info, PHASE_OTHER);
+
+    if (nonce_format == NONCE_DECIMAL && count > 1) {
+        uint64_t next = 10;
+        while (next <= start && next <= UINT64_MAX / 10)
+            next *= 10;
+        if (next > start && next - start < (uint64_t) count) {
+            int first = next - start;
+            int found = scan_nonces(info, start, first, target, hash);
+            if (found >= 0)
+                return found;
+            found = scan_nonces(info, next, count - first, target, hash);
+            return found < 0 ? -1 : first + found;
+        }
+    }
+
+    /* The digits only need to be formatted once; after that they are
+     * counted up in place, so the message holds nonce start + i - 1 at the
+     * top of each iteration below */
+    int i = 0, j, t;
+    if (engine.scan != NULL && count >= lanes) {
+        int lo, hi;
+        varying_words(info, start, start + count - 1, &lo, &hi);
+        int blocks = info->buf->tail_blocks;
+        for (j = 0; j < lanes; j++)
+            for (t = 0; t < 16 * blocks; t++)
+                info->buf->lane_words[t * lanes + j] = info->buf->tail_words[t];
+
+        struct scan_prefix prefix;
+        if (engine.scan_from != NULL)
+            engine.prefix(&prefix, info->job->midstate, info->buf->tail_words,
+                    blocks, lo);
+
+        for (; i + lanes <= count; i += lanes) {
+            if (atomic_load_explicit(&info->job->solution_found, memory_order_relaxed)) {
+                count_hashes(info, i);
+                return -1;
+            }
+
+            for (j = 0; j < lanes; j++) {
+                if (i + j > 0)
+                    increment_nonce(info);
+                for (t = lo; t <= hi; t++)
+                    info->buf->lane_words[t * lanes + j] = info->buf->tail_words[t];
+            }
+            PROFILE_LAP(info, PHASE_FORMAT);
+
+            uint32_t hits;
+            if (engine.scan_from != NULL) {
+                hits = engine.scan_from(&prefix, info->buf->lane_words, target[0]);
+            } else {
+                hits = engine.scan(info->job->midstate, info->buf->lane_words,
+                        blocks, target[0]);
+            }
+            PROFILE_LAP(info, PHASE_HASH);
+
+            if (hits != 0) {
+                while (hits != 0) {
+                    int lane = __builtin_ctz(hits);
+                    hits &= hits - 1;
+                    set_nonce(info, start + i + lane);
+                    hash_tail(info, hash);
+                    if (meets_target(hash, target)) {
+                        PROFILE_LAP(info, PHASE_CHECK);
+                        count_hashes(info, i + lane + 1);
+                        return i + lane;
+                    }
+                }
+                /* Only tied on the front word; carry on from the group's
+                 * last nonce */
+                set_nonce(info, start + i + lanes - 1);
+                PROFILE_LAP(info, PHASE_CHECK);
+            }
+        }
+    } else {
+        set_nonce(info, start);
+    }
+
+    /* Whatever did not fill a whole group (or everything, without a vector
+     * kernel) is hashed one at a time */
+    for (; i < count; ++i) {
+        if (i % STOP_CHECK_INTERVAL == 0
+                && atomic_load_explicit(&info->job->solution_found, memory_order_relaxed)) {
+            count_hashes(info, i);
+            return -1;
+        }
+
+        if (i > 0)
+            increment_nonce(info);
+        PROFILE_LAP(info, PHASE_FORMAT);
+
+        /* Hash the block tail and nonce digits, for example 'Hello World!'
+         * and '10' hash as 'Hello World!10' (the full 64-byte blocks in
+         * front of the tail are already absorbed in the midstate) */
+        uint32_t front = hash_front(info);
+        PROFILE_LAP(info, PHASE_HASH);
+
+        /* Only a likely solution is worth hashing in full */
+        if (front <= target[0]) {
+            hash_tail(info, hash);
+            bool solved = meets_target(hash, target);
+            PROFILE_LAP(info, PHASE_CHECK);
+            if (solved) {
+                count_hashes(info, i + 1);
+                return i;
+            }
+        }
+    }
+
+    count_hashes(info, count);
+    return -1;
+}
+
+/* Function: mine_range
+ * --------------------
+ * Hashes nonces [start, start + count) of info->job, leaving out any that a
+ * resumed checkpoint has already searched, and records the solution if one
+ * turns up. In find-all mode solutions are kept and the search carries on,
+ * as it does after a share.
+ * With checkpointing on, every piece searched in full is logged for the
+ * checkpoint thread.
+ *
+ * info: worker doing the work
+ * start: first nonce
+ * count: number of nonces, at most MAX_NONCES_PER_TASK
+ *
+ * returns: true if this worker found a solution
+ */
+bool mine_range(struct thread_info *info, uint64_t start, uint64_t count) {
+    uint64_t end = start + count;
+    while (start < end) {
+        uint64_t limit = end;
+        start = skip_searched(start, &limit);
+        if (start >= end)
+            break;
+
+        int n = limit - start;
+        uint64_t hashed = info->num_inversions;
+        const uint32_t *target = info->job->target;
+        if (top_k > 0 && info->found.count == top_k)
+            target = info->found.items[0].hash;
+        else if (shares_on)
+            target = share_target;
+        uint32_t hash[HASH_MAX_WORDS];
+        int found = scan_nonces(info, start, n, target, hash);
+        bool share_only = false;
+        if (found >= 0 && shares_on) {
+            /* Every solution is a share, but most shares aren't solutions */
+            report_share(info, start + found, hash);
+            share_only = !meets_target(hash, info->job->target);
+        }
+        if (found >= 0 && !share_only && !find_all) {
+            record_solution(info, start + found, hash);
+            return true;
+        }
+        if (found >= 0) {
+            if (!share_only)
+                keep_solution(info, start + found, hash);
+            n = found + 1;
+        } else if (info->num_inversions - hashed < n) {
+            return false; /* stopped early */
+        }
+
+        if (info->searched_log != NULL)
+            log_searched(info, start, start + n);
+        start += n;
+    }
+    return false;
+}
+
+/* Function: range_set_add
+ * -----------------------
+ * Adds [start, end) to a range set, merging it with any ranges it overlaps
+ * or touches.
+ */
+void range_set_add(struct range_set *set, uint64_t start, uint64_t end) {
+    /* First range that ends at or after start */
+    size_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (set->ranges[mid].end < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    size_t last = lo;
+    while (last < set->count && set->ranges[last].start <= end) {
+        if (set->ranges[last].start < start)
+            start = set->ranges[last].start;
+        if (set->ranges[last].end > end)
+            end = set->ranges[last].end;
+        last++;
+    }
+
+    if (last > lo) {
+        /* Replaces ranges lo..last-1 */
+        memmove(set->ranges + lo + 1, set->ranges + last,
+                sizeof(struct range) * (set->count - last));
+        set->count -= last - lo - 1;
+    } else {
+        if (set->count == set->capacity) {
+            set->capacity = set->capacity ? set->capacity * 2 : 64;
+            set->ranges = realloc(set->ranges, sizeof(struct range) * set->capacity);
+        }
+        memmove(set->ranges + lo + 1, set->ranges + lo,
+                sizeof(struct range) * (set->count - lo));
+        set->count++;
+    }
+    set->ranges[lo].start = start;
+    set->ranges[lo].end = end;
+}
+
+/* Function: skip_searched
+ * -----------------------
+ * Looks nonce up in resume_searched.
+ *
+ * nonce: next nonce to hash
+ * limit: lowered, if need be, to where the next searched range begins
+ *
+ * returns: the first nonce at or after nonce that still needs hashing
+ */
+uint64_t skip_searched(uint64_t nonce, uint64_t *limit) {
+    const struct range_set *set = &resume_searched;
+    if (set->count == 0)
+        return nonce;
+
+    /* First range that ends after nonce */
+    size_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (set->ranges[mid].end <= nonce)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < set->count && set->ranges[lo].start <= nonce)
+        nonce = set->ranges[lo++].end;
+    if (lo < set->count && set->ranges[lo].start < *limit)
+        *limit = set->ranges[lo].start;
+    return nonce;
+}
+
+/* Function: log_searched
+ * ----------------------
+ * Hands a searched range to the checkpoint thread. The worker never waits:
+ * if its log is full the range is left out, and only gets searched again
+ * should the run be resumed.
+ */
+void log_searched(struct thread_info *info, uint64_t start, uint64_t end) {
+    struct searched_log *log = info->searched_log;
+    uint64_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+    if (head - tail == SEARCHED_LOG_SIZE)
+        return;
+
+    log->ranges[head % SEARCHED_LOG_SIZE].start = start;
+    log->ranges[head % SEARCHED_LOG_SIZE].end = end;
+    atomic_store_explicit(&log->head, head + 1, memory_order_release);
+}
+
+/* Function: drain_searched_logs
+ * -----------------------------
+ * Moves everything in the workers' searched_logs into searched. Checkpoint
+ * thread only.
+ */
+void drain_searched_logs(void) {
+    unsigned int i;
+    for (i = 0; i < num_workers; i++) {
+        struct searched_log *log = workers[i]->searched_log;
+        uint64_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+        for (; tail < head; tail++) {
+            struct range *range = &log->ranges[tail % SEARCHED_LOG_SIZE];
+            range_set_add(&searched, range->start, range->end);
+        }
+        atomic_store_explicit(&log->tail, tail, memory_order_release);
+    }
+}
+
+/* Function: checkpoint_fingerprint
+ * --------------------------------
+ * Identifies a job in its checkpoint file, so progress is never applied to
+ * a different block or target: the target in hex, then the SHA-1 of the
+ * block data, then the engine unless it is SHA-1, and for binary nonces the
+ * byte order and where the nonce goes.
+ */
+void checkpoint_fingerprint(const struct job *job, char out[160]) {
+    uint8_t digest[20];
+    sha1sum(digest, (char *) job->data);
+    hash_tostring(out, job->target, engine.words);
+    out += strlen(out);
+    sha1tostring(out, digest);
+    out += strlen(out);
+    if (strcmp(engine.name, "sha1") != 0)
+        out += sprintf(out, "/%s", engine.name);
+    if (nonce_format != NONCE_DECIMAL) {
+        sprintf(out, "/%s@%llu", nonce_format == NONCE_BINARY_LE ? "le" : "be",
+                (unsigned long long) (job->absorbed + job->nonce_pos));
+    }
+}
+
+/* Function: write_checkpoint
+ * --------------------------
+ * Saves searched to checkpoint_path. The file is written under a temporary
+ * name and renamed over the old one, so a crash mid-write leaves the
+ * previous checkpoint intact.
+ *
+ * returns: 0, or -1 if the file could not be written
+ */
+int write_checkpoint(const struct job *job) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", checkpoint_path);
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror(tmp_path);
+        return -1;
+    }
+
+    char fingerprint[160];
+    checkpoint_fingerprint(job, fingerprint);
+    fprintf(file, "mine checkpoint\njob %s\n", fingerprint);
+    size_t i;
+    for (i = 0; i < searched.count; i++) {
+        fprintf(file, "searched %llu %llu\n",
+                (unsigned long long) searched.ranges[i].start,
+                (unsigned long long) searched.ranges[i].end);
+    }
+
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, checkpoint_path) != 0) {
+        perror(checkpoint_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Function: load_checkpoint
+ * -------------------------
+ * Reads the ranges already searched for job from checkpoint_path into
+ * resume_searched.
+ *
+ * returns: 0 if they were loaded, 1 if there is no checkpoint yet, or -1
+ *          if the file is unreadable or belongs to another job
+ */
+int load_checkpoint(const struct job *job) {
+    FILE *file = fopen(checkpoint_path, "r");
+    if (file == NULL)
+        return errno == ENOENT ? 1 : -1;
+
+    char expected[160], fingerprint[160];
+    checkpoint_fingerprint(job, expected);
+    int status = 0;
+    if (fscanf(file, "mine checkpoint job %159s", fingerprint) != 1)
+        status = -1;
+    else if (strcmp(fingerprint, expected) != 0)
+        status = -1;
+
+    unsigned long long start, end;
+    while (status == 0 && fscanf(file, " searched %llu %llu", &start, &end) == 2) {
+        if (start < end)
+            range_set_add(&resume_searched, start, end);
+    }
+    if (status == 0 && !feof(file))
+        status = -1;
+    fclose(file);
+    return status;
+}
+
+/* Function: checkpoint_main
+ * -------------------------
+ * Checkpoint thread: collects the workers' searched ranges and writes them
+ * out periodically, and once more after checkpoint_done is set.
+ *
+ * arg: the job being mined
+ */
+void *checkpoint_main(void *arg) {
+    const struct job *job = arg;
+    double last_write = get_time();
+    while (!atomic_load(&checkpoint_done)) {
+        struct timespec pause = { 0, CHECKPOINT_DRAIN_SECONDS * 1e9 };
+        nanosleep(&pause, NULL);
+        drain_searched_logs();
+
+        double now = get_time();
+        if (now - last_write >= CHECKPOINT_SECONDS) {
+            write_checkpoint(job);
+            last_write = now;
+        }
+    }
+
+    drain_searched_logs();
+    write_checkpoint(job);
+    return NULL;
+}
+
+/* Runs on SIGINT/SIGTERM while checkpointing or in find-all mode: stops
+ * the job so the last checkpoint gets written, or what was found so far
+ * gets printed */
+static void interrupt_signal(int sig) {
+    if (interrupt_job != NULL)
+        atomic_store(&interrupt_job->solution_found, true);
+}
+
+/* Function: report_share
+ * ----------------------
+ * Hands a share to the reporter thread. Like log_searched(), the worker
+ * never waits: if its share_log is full the share is only counted as
+ * dropped.
+ */
+void report_share(struct thread_info *info, uint64_t nonce,
+        const uint32_t hash[HASH_MAX_WORDS]) {
+    struct share_log *log = info->share_log;
+    uint64_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+    if (head - tail == SHARE_LOG_SIZE) {
+        atomic_store_explicit(&log->dropped,
+                atomic_load_explicit(&log->dropped, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+        return;
+    }
+
+    struct found *share = &log->shares[head % SHARE_LOG_SIZE];
+    share->nonce = nonce;
+    memcpy(share->hash, hash, sizeof(share->hash));
+    atomic_store_explicit(&log->head, head + 1, memory_order_release);
+}
+
+/* Function: drain_shares
+ * ----------------------
+ * Prints a 'share thread nonce hash' line for everything in the workers'
+ * share_logs, flushing once for the lot. Reporter thread only.
+ */
+void drain_shares(void) {
+    unsigned int i;
+    for (i = 0; i < num_workers; i++) {
+        struct share_log *log = workers[i]->share_log;
+        uint64_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+        for (; tail < head; tail++) {
+            const struct found *share = &log->shares[tail % SHARE_LOG_SIZE];
+            char hash[8 * HASH_MAX_WORDS + 1];
+            hash_tostring(hash, share->hash, engine.words);
+            fprintf(log_out, "share %u %llu %s\n", i,
+                    (unsigned long long) share->nonce, hash);
+            log->reported++;
+        }
+        atomic_store_explicit(&log->tail, tail, memory_order_release);
+    }
+    fflush(log_out);
+}
+
+/* Function: share_main
+ * --------------------
+ * Share reporter thread: drains the share_logs every SHARE_REPORT_SECONDS
+ * until shares_done is set, and once more after.
+ */
+void *share_main(void *arg) {
+    while (!atomic_load(&shares_done)) {
+        struct timespec pause = { 0, SHARE_REPORT_SECONDS * 1e9 };
+        nanosleep(&pause, NULL);
+        drain_shares();
+    }
+    drain_shares();
+    return NULL;
+}
+
+/* Function: print_share_totals
+ * ----------------------------
+ * Prints how many shares each worker contributed, and how many its full
+ * share_log made it drop.
+ */
+void print_share_totals(void) {
+    uint64_t total = 0, dropped = 0;
+    unsigned int i;
+    printf("Shares by thread:");
+    for (i = 0; i < num_workers; i++) {
+        const struct share_log *log = workers[i]->share_log;
+        uint64_t lost = atomic_load(&log->dropped);
+        printf(" %u:%llu", i, (unsigned long long) (log->reported + lost));
+        total += log->reported + lost;
+        dropped += lost;
+    }
+    printf("\n%llu shares (%llu not reported, share log full)\n",
+            (unsigned long long) total, (unsigned long long) dropped);
+}
+
+/* Function: stats_threads
+ * -----------------------
+ * returns: how many threads the stats cover: the CPU workers, then one host
+ *          thread per GPU
+ */
+static unsigned int stats_threads(void) {
+#ifdef MINE_OPENCL
+    return num_workers + num_gpu_devices;
+#else
+    return num_workers;
+#endif
+}
+
+/* Function: stats_thread_info
+ * ---------------------------
+ * returns: thread i of those stats_threads() counts
+ */
+static struct thread_info *stats_thread_info(unsigned int i) {
+#ifdef MINE_OPENCL
+    if (i >= num_workers)
+        return gpu_host_thread(i - num_workers);
+#endif
+    return workers[i];
+}
+
+/* Function: stats_sample
+ * ----------------------
+ * Reads every thread's published hash count and task wait time. They are
+ * written with relaxed stores, so this never slows the threads down, and
+ * each value is at most a task out of date.
+ *
+ * hashes, wait: stats_threads() entries each
+ *
+ * returns: the total hash count
+ */
+static uint64_t stats_sample(uint64_t hashes[], double wait[]) {
+    uint64_t total = 0;
+    unsigned int i;
+    for (i = 0; i < stats_threads(); i++) {
+        const struct thread_info *info = stats_thread_info(i);
+        hashes[i] = atomic_load_explicit(&info->num_inversions, memory_order_relaxed);
+        wait[i] = atomic_load_explicit(&info->wait_total, memory_order_relaxed);
+        total += hashes[i];
+    }
+    return total;
+}
+
+/* Function: print_stats
+ * ---------------------
+ * Writes one stats line to log_out: the hash rate since the last line and
+ * since the start, the rate of each worker and then each GPU, and the share
+ * of their time the CPU workers spent getting tasks (measured with
+ * --task-size=auto only).
+ * With --stats-json the line is a JSON object instead.
+ *
+ * elapsed: seconds since the stats thread started
+ * interval: seconds since the last line
+ * last: each thread's hash count at the last line, updated here
+ */
+static void print_stats(double elapsed, double interval, uint64_t last[]) {
+    unsigned int threads = stats_threads();
+    uint64_t hashes[threads > 0 ? threads : 1];
+    double wait[threads > 0 ? threads : 1];
+    uint64_t total = stats_sample(hashes, wait);
+    uint64_t previous = 0;
+    double wait_sum = 0;
+    unsigned int i;
+    for (i = 0; i < threads; i++) {
+        previous += last[i];
+        if (i < num_workers)
+            wait_sum += wait[i];  /* GPU host threads don't time theirs */
+    }
+    double rate = (total - previous) / interval;
+    double average = total / elapsed;
+
+    if (stats_json) {
+        fprintf(log_out, "{\"elapsed\":%.3f,\"hashes\":%llu,\"rate\":%.1f,"
+                "\"average_rate\":%.1f,\"task_size\":%u,\"threads\":[", elapsed,
+                (unsigned long long) total, rate, average,
+                (unsigned int) shared.nonces_per_task);
+        for (i = 0; i < threads; i++) {
+            fprintf(log_out, "%s{\"id\":%u,\"hashes\":%llu,\"rate\":%.1f",
+                    i ? "," : "", i, (unsigned long long) hashes[i],
+                    (hashes[i] - last[i]) / interval);
+            if (task_size_auto && i < num_workers)
+                fprintf(log_out, ",\"wait_seconds\":%.6f", wait[i]);
+            fprintf(log_out, "}");
+        }
+        fprintf(log_out, "]}\n");
+    } else {
+        fprintf(log_out, "[%7.1fs] %.2f Mhash/s (average %.2f), %llu hashes; "
+                "per thread:", elapsed, rate / 1e6, average / 1e6,
+                (unsigned long long) total);
+        for (i = 0; i < threads; i++)
+            fprintf(log_out, " %.2f", (hashes[i] - last[i]) / interval / 1e6);
+        if (task_size_auto && num_workers > 0)
+            fprintf(log_out, "; task wait %.2f%%",
+                    wait_sum / (elapsed * num_workers) * 100);
+        fprintf(log_out, "\n");
+    }
+    fflush(log_out);
+
+    memcpy(last, hashes, sizeof(uint64_t) * threads);
+}
+
+/* Function: serve_metrics
+ * -----------------------
+ * Answers one HTTP request on the --metrics socket with the counters in
+ * the Prometheus text format, whatever path was asked for.
+ *
+ * elapsed: seconds since the stats thread started
+ */
+static void serve_metrics(double elapsed) {
+    int fd = accept(metrics_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+
+    /* Read the request if it arrives promptly; its contents don't matter */
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 1000) > 0) {
+        char request[NET_LINE_MAX];
+        if (read(fd, request, sizeof(request)) < 0) {
+            close(fd);
+            return;
+        }
+    }
+
+    unsigned int threads = stats_threads();
+    uint64_t hashes[threads > 0 ? threads : 1];
+    double wait[threads > 0 ? threads : 1];
+    uint64_t total = stats_sample(hashes, wait);
+
+    net_send(fd, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+    net_send(fd, "# HELP mine_hashes_total Hashes computed.\n"
+            "# TYPE mine_hashes_total counter\n");
+    net_send(fd, "mine_hashes_total %llu\n", (unsigned long long) total);
+    net_send(fd, "# HELP mine_thread_hashes_total Hashes computed by each worker.\n"
+            "# TYPE mine_thread_hashes_total counter\n");
+    unsigned int i;
+    for (i = 0; i < threads; i++)
+        net_send(fd, "mine_thread_hashes_total{thread=\"%u\"} %llu\n", i,
+                (unsigned long long) hashes[i]);
+    if (task_size_auto) {
+        net_send(fd, "# HELP mine_thread_task_wait_seconds_total Time each "
+                "worker spent getting tasks.\n"
+                "# TYPE mine_thread_task_wait_seconds_total counter\n");
+        for (i = 0; i < num_workers; i++)
+            net_send(fd, "mine_thread_task_wait_seconds_total{thread=\"%u\"} "
+                    "%.6f\n", i, wait[i]);
+    }
+    net_send(fd, "# HELP mine_task_size Nonces per task.\n"
+            "# TYPE mine_task_size gauge\n"
+            "mine_task_size %u\n", (unsigned int) shared.nonces_per_task);
+    net_send(fd, "# HELP mine_uptime_seconds Time since mining started.\n"
+            "# TYPE mine_uptime_seconds gauge\n"
+            "mine_uptime_seconds %.3f\n", elapsed);
+    close(fd);
+}
+
+/* Function: stats_main
+ * --------------------
+ * Stats thread: prints a stats line every stats_interval seconds (if it
+ * is positive) and answers metrics requests, until stats_done is set.
+ */
+void *stats_main(void *arg) {
+    unsigned int threads = stats_threads();
+    uint64_t last[threads > 0 ? threads : 1];
+    double wait[threads > 0 ? threads : 1];
+    stats_sample(last, wait);
+
+    double start = get_time();
+    double last_line = start;
+    while (!atomic_load(&stats_done)) {
+        double now = get_time();
+        if (stats_interval > 0 && now - last_line >= stats_interval) {
+            print_stats(now - start, now - last_line, last);
+            last_line = now;
+        }
+
+        /* Wake up for the next line, a metrics request or stats_done,
+         * whichever comes first */
+        double pause = STATS_POLL_SECONDS;
+        if (stats_interval > 0 && last_line + stats_interval - now < pause)
+            pause = last_line + stats_interval - now;
+        if (pause < 0)
+            pause = 0;
+        if (metrics_fd >= 0) {
+            struct pollfd pfd = { metrics_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, pause * 1000) > 0)
+                serve_metrics(get_time() - start);
+        } else {
+            struct timespec ts = { 0, pause * 1e9 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Function: stop_stats
+ * --------------------
+ * Stops the stats thread, if it is running, and waits for it to exit.
+ */
+void stop_stats(void) {
+    if (!stats_running)
+        return;
+    atomic_store(&stats_done, true);
+    pthread_join(stats_thread, NULL);
+    stats_running = false;
 }
 
 /* Function: mine
  * --------------
  *
- * Uses mutex and condition waiting to communicate to producer and other threads.
- * Mines for a solution based off bitcoin_block_data and difficulty_mask.
+ * Worker thread entry point: takes the worker's buffers from its arena,
+ * then mines each job the pool is given with the selected scheduler until
+ * the pool shuts down.
+ *
+ * arg: thread to create
+ */
+void *mine(void *arg) {
+
+    struct thread_info *info = (struct thread_info *) arg;
+
+    /* Only this thread writes to buf, so with the kernel's first-touch
+     * policy its pages land on the NUMA node the thread runs on */
+    info->buf = arena_alloc(&info->arena, sizeof(struct hash_buffers));
+
+#ifdef MINE_PROFILE
+    info->profile_mark = profile_ticks();
+#endif
+    if (scheduler == SCHED_STEAL)
+        mine_steal(info);
+
+    unsigned long generation = 0;
+    struct job *job;
+    while (scheduler != SCHED_STEAL && (job = wait_for_job(&generation)) != NULL) {
+        info->job = job;
+        PROFILE_LAP(info, PHASE_IDLE);
+
+        /* The block tail never changes during a job, so lay it down once */
+        load_message(info);
+        PROFILE_LAP(info, PHASE_FORMAT);
+
+        uint64_t hashed = info->num_inversions;
+        if (scheduler == SCHED_ATOMIC)
+            mine_atomic(info);
+        else
+            mine_queue(info);
+        PROFILE_LAP(info, PHASE_OTHER);
+        finish_job(info, info->num_inversions - hashed);
+    }
+    return NULL;
+}
+
+/* Function: mine_queue
+ * --------------------
+ *
+ * Worker loop for the queue scheduler: takes up to TASK_BATCH tasks at a
+ * time off shared.tasks and mines them, sleeping only while the ring is
+ * empty, until a solution is found or the producer has stopped and the
+ * ring is drained.
+ *
+ * info: this worker
+ */
+void *mine_queue(struct thread_info *info) {
+    struct job *job = info->job;
+    struct task tasks[TASK_BATCH];
+
+    double wait_start = task_size_auto ? get_time() : 0;
+    while (!job->solution_found) {
+        PROFILE_LAP(info, PHASE_OTHER);
+
+        /* Checked before the ring: once the producer is done, a ring that
+         * is empty stays empty */
+        bool done = queue_done(job);
+        int n = task_ring_pop(&shared.tasks, tasks, TASK_BATCH);
+        if (n == 0) {
+            if (done)
+                break;
+            task_ring_park(&shared.tasks, true, queue_done, job);
+            continue;
+        }
+        PROFILE_LAP(info, PHASE_WAIT);
+
+        int i;
+        for (i = 0; i < n && !job->solution_found; i++) {
+            double work_start = task_size_auto ? get_time() : 0;
+            mine_range(info, tasks[i].start, tasks[i].count);
+            if (task_size_auto) {
+                /* The ring still holds tasks cut before the size last
+                 * changed; timing those would just grow it again */
+                double work_end = get_time();
+                if (tasks[i].count == shared.nonces_per_task)
+                    tune_task_size(info, work_start - wait_start, work_end - work_start);
+                wait_start = work_end;
+            }
+        }
+    }
+
+    info->stop_time = get_time();
+    return NULL;
+}
+
+/* Function: mine_atomic
+ * ---------------------
+ *
+ * Worker loop for the atomic scheduler: claims nonces_per_task nonces at a
+ * time with a single fetch-add on the job's next_nonce until a solution is
+ * found.
+ *
+ * info: this worker
+ */
+void *mine_atomic(struct thread_info *info) {
+    struct job *job = info->job;
+    double wait_start = task_size_auto ? get_time() : 0;
+    while (!job->solution_found) {
+        PROFILE_LAP(info, PHASE_OTHER);
+        uint32_t count = atomic_load_explicit(&shared.nonces_per_task,
+                memory_order_relaxed);
+        uint64_t start = atomic_fetch_add_explicit(&job->next_nonce, count,
+                memory_order_relaxed);
+        if (start >= job->range_end || start > UINT64_MAX - count)
+            break;
+        if (count > job->range_end - start)
+            count = job->range_end - start;
+        PROFILE_LAP(info, PHASE_WAIT);
+
+        double work_start = task_size_auto ? get_time() : 0;
+        if (mine_range(info, start, count))
+            break;
+
+        if (task_size_auto) {
+            double work_end = get_time();
+            tune_task_size(info, work_start - wait_start, work_end - work_start);
+            wait_start = work_end;
+        }
+    }
+
+    info->stop_time = get_time();
+    return NULL;
+}
+
+/* Function: deque_grow
+ * --------------------
+ * Doubles a deque's ring buffer, unwrapping its chunks to the start. Called
+ * with the deque locked.
+ */
+static void deque_grow(struct deque *deque) {
+    size_t capacity = deque->capacity ? deque->capacity * 2 : 16;
+    struct chunk *chunks = malloc(sizeof(struct chunk) * capacity);
+    size_t i;
+    for (i = 0; i < deque->count; i++)
+        chunks[i] = deque->chunks[(deque->top + i) % deque->capacity];
+    free(deque->chunks);
+    deque->chunks = chunks;
+    deque->capacity = capacity;
+    deque->top = 0;
+}
+
+/* Function: deque_push
+ * --------------------
+ * Adds a chunk to a deque, on top (where thieves take from) or at the
+ * bottom (where the owner takes from next).
+ */
+static void deque_push(struct deque *deque, struct chunk chunk, bool top) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity)
+        deque_grow(deque);
+    if (top) {
+        deque->top = (deque->top + deque->capacity - 1) % deque->capacity;
+        deque->chunks[deque->top] = chunk;
+    } else {
+        deque->chunks[(deque->top + deque->count) % deque->capacity] = chunk;
+    }
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/* Function: deque_pop
+ * -------------------
+ * Takes the owner's next chunk off the bottom of its deque.
+ *
+ * returns: false if the deque is empty
+ */
+static bool deque_pop(struct deque *deque, struct chunk *chunk) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        *chunk = deque->chunks[(deque->top + deque->count) % deque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/* Function: deque_steal
+ * ---------------------
+ * Takes work off the top of another worker's deque. A chunk worth at least
+ * two tasks is split: the thief takes its first half, or STEAL_TASKS tasks
+ * if that is less, and the owner keeps the rest.
+ *
+ * returns: false if the deque is empty
+ */
+static bool deque_steal(struct deque *deque, struct chunk *chunk, uint32_t task_size) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        struct chunk *victim = &deque->chunks[deque->top];
+        *chunk = *victim;
+        uint64_t span = victim->end - victim->start;
+        if (span >= 2 * (uint64_t) task_size) {
+            uint64_t take = span / 2;
+            if (take > (uint64_t) task_size * STEAL_TASKS)
+                take = (uint64_t) task_size * STEAL_TASKS;
+            chunk->end = victim->start + take;
+            victim->start = chunk->end;
+            atomic_fetch_add(&chunk->job->refs, 1);
+        } else {
+            deque->top = (deque->top + 1) % deque->capacity;
+            deque->count--;
+        }
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/* Function: wake_workers
+ * ----------------------
+ * Tells idle workers that there are chunks to take.
+ */
+static void wake_workers(void) {
+    atomic_fetch_add(&shared.work_seq, 1);
+    if (atomic_load(&shared.idle_workers) > 0) {
+        pthread_mutex_lock(&pool_mutex);
+        pthread_cond_broadcast(&work_available);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+
+/* Function: find_chunk
+ * --------------------
+ * Gets the worker's next chunk: its own bottom chunk if it has one, or else
+ * one stolen from the other workers, tried in a random order.
+ *
+ * returns: false if there is no work anywhere
+ */
+bool find_chunk(struct thread_info *info, struct chunk *chunk) {
+    if (deque_pop(&info->deque, chunk))
+        return true;
+
+    uint32_t task_size = atomic_load_explicit(&shared.nonces_per_task,
+            memory_order_relaxed);
+    uint32_t x = info->steal_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    info->steal_seed = x;
+
+    unsigned int i;
+    for (i = 0; i < num_workers; i++) {
+        struct thread_info *victim = workers[(x + i) % num_workers];
+        if (victim != info && deque_steal(&victim->deque, chunk, task_size))
+            return true;
+    }
+    return false;
+}
+
+/* Function: mine_steal
+ * --------------------
+ *
+ * Worker loop for the work-stealing scheduler: takes a chunk, hashes the
+ * first nonces_per_task nonces of it and puts the rest back on top of its
+ * deque, until the pool shuts down. Chunks of solved jobs are dropped.
+ *
+ * info: this worker
+ */
+void *mine_steal(struct thread_info *info) {
+    double wait_start = task_size_auto ? get_time() : 0;
+    while (true) {
+        PROFILE_LAP(info, PHASE_OTHER);
+        struct chunk chunk;
+        unsigned long seq = atomic_load(&shared.work_seq);
+        if (!find_chunk(info, &chunk)) {
+            /* Nothing to do: sleep until somebody queues work. We check
+             * work_seq after announcing we're idle, so a new job can't be
+             * missed. The rest of a split chunk only wakes us if its owner
+             * saw us idle, but then it splits again a task later. */
+            pthread_mutex_lock(&pool_mutex);
+            atomic_fetch_add(&shared.idle_workers, 1);
+            while (atomic_load(&shared.work_seq) == seq && !pool_shutdown)
+                pthread_cond_wait(&work_available, &pool_mutex);
+            atomic_fetch_sub(&shared.idle_workers, 1);
+            bool shutdown = pool_shutdown;
+            pthread_mutex_unlock(&pool_mutex);
+            PROFILE_LAP(info, PHASE_IDLE);
+            if (shutdown)
+                break;
+            wait_start = task_size_auto ? get_time() : 0;
+            continue;
+        }
+
+        struct job *job = chunk.job;
+        if (job->solution_found) {
+            release_job(job);
+            continue;
+        }
+
+        uint64_t count = chunk.end - chunk.start;
+        uint32_t size = atomic_load_explicit(&shared.nonces_per_task,
+                memory_order_relaxed);
+        if (count > size) {
+            struct chunk rest = { job, chunk.start + size, chunk.end };
+            atomic_fetch_add(&job->refs, 1);
+            deque_push(&info->deque, rest, true);
+            if (atomic_load_explicit(&shared.idle_workers, memory_order_relaxed) > 0)
+                wake_workers();
+            count = size;
+        }
+
+        /* Consecutive tasks may come from different jobs */
+        PROFILE_LAP(info, PHASE_WAIT);
+        info->job = job;
+        load_message(info);
+        PROFILE_LAP(info, PHASE_FORMAT);
+
+        double work_start = task_size_auto ? get_time() : 0;
+        uint64_t hashed = info->num_inversions;
+        mine_range(info, chunk.start, count);
+        atomic_fetch_add_explicit(&job->hashes, info->num_inversions - hashed,
+                memory_order_relaxed);
+        info->job = NULL;
+        release_job(job);
+
+        if (task_size_auto) {
+            double work_end = get_time();
+            tune_task_size(info, work_start - wait_start, work_end - work_start);
+            wait_start = work_end;
+        }
+    }
+
+    info->stop_time = get_time();
+    return NULL;
+}
+
+/* Function: tune_task_size
+ * ------------------------
+ * Records how long a worker spent getting a task versus hashing it, and
+ * every TASK_SIZE_SAMPLES tasks doubles nonces_per_task if getting tasks
+ * took more than TASK_OVERHEAD_TARGET of the time. Growth stops once a task
+ * takes MAX_TASK_SECONDS to hash.
+ *
+ * info: worker that finished a task
+ * wait: seconds spent waiting for / claiming the task
+ * work: seconds spent hashing it
+ */
+void tune_task_size(struct thread_info *info, double wait, double work) {
+    info->wait_time += wait;
+    info->work_time += work;
+    atomic_store_explicit(&info->wait_total,
+            atomic_load_explicit(&info->wait_total, memory_order_relaxed) + wait,
+            memory_order_relaxed);
+    if (++info->tasks_sampled < TASK_SIZE_SAMPLES)
+        return;
+
+    double overhead = info->wait_time / (info->wait_time + info->work_time);
+    double task_time = info->work_time / info->tasks_sampled;
+    info->wait_time = 0;
+    info->work_time = 0;
+    info->tasks_sampled = 0;
+
+    uint32_t size = atomic_load_explicit(&shared.nonces_per_task, memory_order_relaxed);
+    if (overhead > TASK_OVERHEAD_TARGET && task_time < MAX_TASK_SECONDS
+            && size < MAX_NONCES_PER_TASK) {
+        /* Another worker may have just grown it; then leave it be */
+        atomic_compare_exchange_strong(&shared.nonces_per_task, &size, size * 2);
+    }
+}
+
+/* Function: record_solution
+ * -------------------------
+ * Saves a solution in the worker's job and tells everyone else to stop. If
+ * two workers find one at the same time only the first is kept.
+ *
+ * info: worker that found the solution
+ * nonce: winning nonce
+ * hash: full hash state for nonce
+ */
+void record_solution(struct thread_info *info, uint64_t nonce,
+        const uint32_t hash[HASH_MAX_WORDS]) {
+    struct job *job = info->job;
+    double now = get_time();
+
+    if (atomic_exchange(&job->solution_found, true))
+        return;
+
+    job->solution_time = now;
+    job->solver = info->thread_id;
+    job->nonce = nonce;
+    hash_tostring(job->solution_hash, hash, engine.words);
+
+    // To wake up main and any idle workers from waiting
+    if (scheduler == SCHED_QUEUE)
+        task_ring_wake_all(&shared.tasks);
+}
+
+/* Function: keep_solution
+ * -----------------------
+ * Find-all mode: adds a solution to the worker's found_list. With top_k
+ * set and the list full, it replaces the worst one kept, which mine_range()
+ * only lets through if it is at least as good.
+ */
+void keep_solution(struct thread_info *info, uint64_t nonce,
+        const uint32_t hash[HASH_MAX_WORDS]) {
+    struct found_list *list = &info->found;
+    struct found item = { nonce };
+    memcpy(item.hash, hash, sizeof(item.hash));
+
+    size_t i;
+    if (top_k > 0 && list->count == top_k) {
+        /* Sift down from the root */
+        i = 0;
+        for (;;) {
+            size_t child = 2 * i + 1;
+            if (child >= list->count)
+                break;
+            if (child + 1 < list->count
+                    && compare_found(&list->items[child + 1], &list->items[child]) > 0)
+                child++;
+            if (compare_found(&list->items[child], &item) <= 0)
+                break;
+            list->items[i] = list->items[child];
+            i = child;
+        }
+        list->items[i] = item;
+        return;
+    }
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, sizeof(struct found) * list->capacity);
+    }
+    i = list->count++;
+    if (top_k > 0) {
+        /* Sift up */
+        while (i > 0 && compare_found(&list->items[(i - 1) / 2], &item) < 0) {
+            list->items[i] = list->items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+    list->items[i] = item;
+}
+
+/* Function: compare_found
+ * -----------------------
+ * qsort() comparison ranking solutions by hash, best (lowest, so most
+ * leading zeros) first, and then by nonce.
+ */
+int compare_found(const void *a, const void *b) {
+    const struct found *x = a;
+    const struct found *y = b;
+    int i;
+    for (i = 0; i < engine.words; i++) {
+        if (x->hash[i] != y->hash[i])
+            return x->hash[i] < y->hash[i] ? -1 : 1;
+    }
+    if (x->nonce != y->nonce)
+        return x->nonce < y->nonce ? -1 : 1;
+    return 0;
+}
+
+/* Orders solutions by nonce */
+static int compare_found_nonce(const void *a, const void *b) {
+    const struct found *x = a;
+    const struct found *y = b;
+    return (x->nonce > y->nonce) - (x->nonce < y->nonce);
+}
+
+/* Function: job_create
+ * --------------------
+ * Sets up a job for data and target, including the midstate of its full
+ * 64-byte blocks in front of the nonce.
+ *
+ * data: block data (copied), already accepted by check_nonce_layout()
+ * target: 160-bit target from get_difficulty()
+ *
+ * returns: the job, to be released with job_free()
+ */
+struct job *job_create(const char *data, const uint32_t target[HASH_MAX_WORDS]) {
+    struct job *job = aligned_alloc(CACHE_LINE, sizeof(struct job));
+    memset(job, 0, sizeof(struct job));
+    job->data = strdup(data);
+    memcpy(job->target, target, sizeof(job->target));
+
+    size_t len = strlen(job->data);
+    size_t offset = len;
+    if (nonce_format != NONCE_DECIMAL && nonce_offset < len)
+        offset = nonce_offset;
+    job->absorbed = engine.midstate(job->midstate, job->data, offset);
+    job->tail = job->data + job->absorbed;
+    job->tail_len = len - job->absorbed;
+    job->nonce_pos = offset - job->absorbed;
+    job->solver = -1;
+    job->range_end = UINT64_MAX;
+    return job;
+}
+
+void job_free(struct job *job) {
+    free(job->data);
+    free(job);
+}
+
+/* Function: run_job
+ * -----------------
+ * Hands job to the worker pool and waits until it is finished. With the
+ * queue scheduler the calling thread produces the tasks.
+ *
+ * job: job to mine
+ * num_threads: number of workers in the pool
+ *
+ * returns: wall clock time the job took, in seconds
+ */
+double run_job(struct job *job, unsigned int num_threads) {
+    job->start_time = get_time();
+
+    if (scheduler == SCHED_STEAL) {
+        submit_job(job);
+    } else {
+        job->next_nonce = job->range_start;
+        /* Whatever was still queued when the last job was solved goes */
+        if (scheduler == SCHED_QUEUE)
+            task_ring_init(&shared.tasks);
+        pthread_mutex_lock(&pool_mutex);
+        job->workers_active = num_threads;
+        current_job = job;
+        job_generation++;
+        pthread_cond_broadcast(&job_posted);
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (scheduler == SCHED_QUEUE)
+            produce_tasks(job);
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    while (!job->finished)
+        pthread_cond_wait(&job_finished, &pool_mutex);
+    current_job = NULL;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return get_time() - job->start_time;
+}
+
+/* Function: submit_job
+ * --------------------
+ * Queues all of a job's nonces as one chunk at the bottom of a worker's
+ * deque, taking the workers in turn, and wakes up the idle ones to steal
+ * from it. Only called from the main thread.
+ */
+void submit_job(struct job *job) {
+    static unsigned int next_worker;
+    struct chunk chunk = { job, job->range_start, job->range_end };
+
+    job->refs = 1;
+    deque_push(&workers[next_worker++ % num_workers]->deque, chunk, false);
+    wake_workers();
+}
+
+/* Function: release_job
+ * ---------------------
+ * Drops the reference held by a chunk that was hashed or thrown away.
+ * Whoever drops the last one finishes the job: it is handed to its
+ * on_finish callback if it has one, otherwise run_job() is woken up.
+ */
+void release_job(struct job *job) {
+    if (atomic_fetch_sub(&job->refs, 1) != 1)
+        return;
+
+    job->last_stop = get_time();
+    if (job->on_finish != NULL) {
+        job->on_finish(job);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    job->finished = true;
+    pthread_cond_broadcast(&job_finished);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Function: wait_for_job
+ * ----------------------
+ * Sleeps until run_job() posts a job newer than the last one this worker
+ * mined.
+ *
+ * generation: the worker's last job_generation, updated on return
  *
- * arg: thread to create
+ * returns: the job to mine, or NULL once the pool is shutting down
  */
-void *mine(void *arg) {
+struct job *wait_for_job(unsigned long *generation) {
+    pthread_mutex_lock(&pool_mutex);
+    while (job_generation == *generation && !pool_shutdown)
+        pthread_cond_wait(&job_posted, &pool_mutex);
 
-    struct thread_info *info = (struct thread_info *) arg;
-    uint64_t *task_nonces = NULL;
+    struct job *job = pool_shutdown ? NULL : current_job;
+    *generation = job_generation;
+    pthread_mutex_unlock(&pool_mutex);
+    return job;
+}
+
+/* Function: finish_job
+ * --------------------
+ * Adds a worker's hashes and stop time to its job's totals; the last worker
+ * to finish wakes up run_job().
+ *
+ * info: worker that stopped mining info->job
+ * hashes: hashes it did for the job
+ */
+void finish_job(struct thread_info *info, uint64_t hashes) {
+    struct job *job = info->job;
+
+    pthread_mutex_lock(&pool_mutex);
+    job->hashes += hashes;
+    if (info->stop_time > job->last_stop)
+        job->last_stop = info->stop_time;
+    if (--job->workers_active == 0) {
+        job->finished = true;
+        pthread_cond_broadcast(&job_finished);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    info->job = NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Function: run_bench
+ * -------------------
+ * Benchmark mode: mines nonces [0, bench_nonces) of data bench_warmup +
+ * bench_runs times against an all-zero target, which no hash meets, so
+ * every run does the same work however lucky the difficulty would make
+ * it. The warmup runs fault in the workers' buffers and let the task size
+ * settle; they are printed but left out of the summary. The measured runs
+ * all use the task size the warmups ended on, with tuning switched off, so
+ * each one mines the same configuration.
+ *
+ * data: block data, already accepted by check_nonce_layout()
+ * pool_size: number of workers in the pool, GPUs included
+ *
+ * returns: 0
+ */
+int run_bench(const char *data, unsigned int pool_size) {
+    static const char *scheduler_names[] = { "queue", "atomic", "steal" };
+    const uint32_t target[HASH_MAX_WORDS] = { 0 };
+    double *rates = malloc(sizeof(double) * bench_runs);
+
+    printf("Benchmark: %llu nonces, %u warmup + %u runs, %s (%s), %s "
+            "scheduler, %u workers\n", (unsigned long long) bench_nonces,
+            bench_warmup, bench_runs, engine.name, engine.kernel,
+            scheduler_names[scheduler], pool_size);
+
+    bool tuned = task_size_auto;
+    unsigned int run;
+    for (run = 0; run < bench_warmup + bench_runs; run++) {
+        bool warmup = run < bench_warmup;
+        if (run == bench_warmup) {
+            task_size_auto = false;
+            printf("Task size: %u nonces (%s)\n", (unsigned int) shared.nonces_per_task,
+                    !tuned ? "fixed" : bench_warmup > 0 ? "settled in warmup" : "initial");
+        }
+
+        struct job *job = job_create(data, target);
+        job->range_end = bench_nonces;
+        double total_time = run_job(job, pool_size);
+        double rate = job->hashes / total_time;
+
+        if (warmup) {
+            printf("warmup %u: %llu hashes in %.3fs (%.2f hashes/sec), task size %u\n",
+                    run + 1, (unsigned long long) job->hashes, total_time, rate,
+                    (unsigned int) shared.nonces_per_task);
+        } else {
+            printf("run %u: %llu hashes in %.3fs (%.2f hashes/sec)\n",
+                    run - bench_warmup + 1, (unsigned long long) job->hashes,
+                    total_time, rate);
+            rates[run - bench_warmup] = rate;
+        }
+        job_free(job);
+    }
+    task_size_auto = tuned;
+
+    double mean = 0, variance = 0;
+    for (run = 0; run < bench_runs; run++)
+        mean += rates[run] / bench_runs;
+    for (run = 0; run < bench_runs; run++)
+        variance += (rates[run] - mean) * (rates[run] - mean);
+    double stddev = bench_runs > 1 ? sqrt(variance / (bench_runs - 1)) : 0;
+
+    qsort(rates, bench_runs, sizeof(double), compare_double);
+    double median = bench_runs % 2 ? rates[bench_runs / 2]
+        : (rates[bench_runs / 2 - 1] + rates[bench_runs / 2]) / 2;
+    printf("Median: %.2f hashes/sec (mean %.2f, stddev %.2f or %.1f%%, "
+            "min %.2f, max %.2f)\n", median, mean, stddev,
+            mean > 0 ? stddev / mean * 100 : 0, rates[0], rates[bench_runs - 1]);
+    printf("Peak RSS: %.1f MB\n", peak_rss() / 1048576.0);
+    free(rates);
+#ifdef MINE_PROFILE
+    print_profile();
+#endif
+    return 0;
+}
+
+/* Function: run_batch
+ * -------------------
+ * Mines one job per line of input. A line is a difficulty (in either form
+ * the command line takes), a space or tab, and the block data, which runs
+ * to the end of the line. Blank lines and lines starting with '#' are
+ * skipped. As each job finishes a result line is printed and flushed:
+ *
+ *     line nonce hash hashes seconds
+ *
+ * or "line error reason" if the line could not be mined. Under the
+ * work-stealing scheduler up to MAX_ACTIVE_JOBS jobs are mined at once, so
+ * easy jobs can overtake hard ones; their results come out in the order
+ * they finish. The other schedulers go through the jobs one by one.
+ *
+ * input: open batch file
+ * num_threads: number of workers in the pool
+ *
+ * returns: 0, or EXIT_FAILURE if any line failed
+ */
+int run_batch(FILE *input, unsigned int num_threads) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    unsigned long line_no = 0;
+    int status = 0;
+
+    while ((len = getline(&line, &capacity, input)) != -1) {
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        uint32_t target[HASH_MAX_WORDS];
+        char *data;
+        const char *error = parse_job_line(line, target, &data);
+        if (error != NULL) {
+            printf("%lu error %s\n", line_no, error);
+            fflush(stdout);
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        struct job *job = job_create(data, target);
+        job->id = line_no;
+        if (scheduler == SCHED_STEAL) {
+            pthread_mutex_lock(&pool_mutex);
+            while (active_jobs >= MAX_ACTIVE_JOBS)
+                pthread_cond_wait(&job_finished, &pool_mutex);
+            active_jobs++;
+            pthread_mutex_unlock(&pool_mutex);
+
+            /* From here on the job belongs to the workers */
+            job->on_finish = batch_job_finished;
+            job->start_time = get_time();
+            submit_job(job);
+        } else {
+            double total_time = run_job(job, num_threads);
+            if (!print_result_line(job, total_time))
+                status = EXIT_FAILURE;
+            job_free(job);
+        }
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    while (active_jobs > 0)
+        pthread_cond_wait(&job_finished, &pool_mutex);
+    if (batch_failed)
+        status = EXIT_FAILURE;
+    pthread_mutex_unlock(&pool_mutex);
+
+    free(line);
+    return status;
+}
+
+/* Function: parse_job_line
+ * -------------------------
+ * Splits a "difficulty block data" line, as used by batch files and the
+ * daemon's SUBMIT command, at its first space or tab.
+ *
+ * line: the line, which is modified
+ * target: receives the target
+ * data: receives the block data (the rest of the line)
+ *
+ * returns: NULL, or what is wrong with the line
+ */
+const char *parse_job_line(char *line, uint32_t target[HASH_MAX_WORDS], char **data) {
+    *data = line + strcspn(line, " \t");
+    if (**data != '\0')
+        *(*data)++ = '\0';
+
+    if (get_difficulty(line, target) != 0)
+        return "invalid difficulty";
+    if (**data == '\0')
+        return "empty block data";
+    return check_nonce_layout(*data);
+}
+
+/* Function: check_nonce_layout
+ * ----------------------------
+ * Checks that a binary nonce fits where --nonce-offset puts it in data:
+ * inside the data, and with no more than two blocks of message left to
+ * hash from the block it lands in.
+ *
+ * returns: NULL, or what is wrong
+ */
+const char *check_nonce_layout(const char *data) {
+    if (nonce_format == NONCE_DECIMAL)
+        return NULL;
+
+    size_t len = strlen(data);
+    if (nonce_offset != SIZE_MAX && nonce_offset > len)
+        return "nonce offset past the end of the block data";
+    size_t offset = nonce_offset < len ? nonce_offset : len;
+    if (len - (offset - offset % 64) + NONCE_BYTES > 119)
+        return "too much block data after the nonce offset";
+    return NULL;
+}
+
+/* Function: batch_job_finished
+ * ----------------------------
+ * on_finish callback for concurrent batch jobs: prints the result line and
+ * frees the job.
+ */
+void batch_job_finished(struct job *job) {
+    bool ok = print_result_line(job, job->last_stop - job->start_time);
+    job_free(job);
+
+    pthread_mutex_lock(&pool_mutex);
+    if (!ok)
+        batch_failed = true;
+    active_jobs--;
+    pthread_cond_broadcast(&job_finished);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Function: print_result_line
+ * ---------------------------
+ * Prints and flushes a batch job's result line.
+ *
+ * job: finished job
+ * seconds: how long it took
+ *
+ * returns: false if the job has no solution
+ */
+bool print_result_line(const struct job *job, double seconds) {
+    if (!job->solution_found) {
+        printf("%lu error no solution\n", job->id);
+        fflush(stdout);
+        return false;
+    }
+
+    printf("%lu %llu %s %llu %.3f\n", job->id,
+            (unsigned long long) job->nonce, job->solution_hash,
+            (unsigned long long) job->hashes, seconds);
+    fflush(stdout);
+    return true;
+}
+
+/* Daemon mode state, all owned by the thread running run_server() except
+ * finished, which workers push onto under pool_mutex before writing a byte
+ * to wake[1] */
+#define MAX_CLIENTS 64
+
+struct server_state {
+    bool node;  /* serving a coordinator (run_node()) rather than clients */
+    int listen_fd;
+    int wake[2];
+    struct connection clients[MAX_CLIENTS];  /* fd is -1 for a free slot */
+    struct job *jobs[MAX_ACTIVE_JOBS];       /* submitted and not reported */
+    unsigned long last_id;
+    struct job *finished;
+};
+
+struct server_state server;
+volatile sig_atomic_t server_stopping;
+
+static void server_signal(int sig) {
+    server_stopping = 1;
+    ssize_t n = write(server.wake[1], "s", 1);
+    (void) n;
+}
+
+/* Function: run_server
+ * --------------------
+ * Serves mining jobs to clients of listen_fd until SIGINT or SIGTERM. The
+ * protocol is one line per command or reply:
+ *
+ *     SUBMIT difficulty block data   queue a job; replies QUEUED id
+ *     REPLACE difficulty block data  cancel this client's jobs, then SUBMIT
+ *     CANCEL id                      stop a job
+ *
+ * When a job is done the client that submitted it gets
+ * "SOLVED id nonce hash hashes seconds" or "CANCELLED id". Anything wrong
+ * with a command gets "ERROR reason". Jobs run on the work-stealing
+ * scheduler, so a new job starts on the next task boundary and a
+ * cancelled one stops within STOP_CHECK_INTERVAL nonces.
+ *
+ * listen_fd: socket from net_listen()
+ * address: the address it listens on, to remove a Unix socket afterwards
+ *
+ * returns: 0, or EXIT_FAILURE if the server could not start
+ */
+int run_server(int listen_fd, const char *address) {
+    int i;
+    server.listen_fd = listen_fd;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        server.clients[i].fd = -1;
+    if (pipe2(server.wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, server_signal);
+    signal(SIGTERM, server_signal);
+    fprintf(log_out, "Listening on %s\n", address);
+
+    while (!server_stopping) {
+        struct pollfd fds[2 + MAX_CLIENTS];
+        int owner[2 + MAX_CLIENTS];
+        int n = 0;
+        fds[n].fd = server.wake[0];
+        fds[n].events = POLLIN;
+        owner[n++] = -1;
+        fds[n].fd = listen_fd;
+        fds[n].events = POLLIN;
+        owner[n++] = -1;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (server.clients[i].fd >= 0) {
+                fds[n].fd = server.clients[i].fd;
+                fds[n].events = POLLIN;
+                owner[n++] = i;
+            }
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents) {
+            char drain[64];
+            while (read(server.wake[0], drain, sizeof(drain)) > 0)
+                ;
+            server_report_finished();
+        }
+
+        if (fds[1].revents) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            for (i = 0; fd >= 0 && i < MAX_CLIENTS; i++) {
+                if (server.clients[i].fd < 0) {
+                    memset(&server.clients[i], 0, sizeof(struct connection));
+                    server.clients[i].fd = fd;
+                    break;
+                }
+            }
+            if (fd >= 0 && i == MAX_CLIENTS) {
+                net_send(fd, "ERROR too many connections\n");
+                close(fd);
+            }
+        }
+
+        int k;
+        for (k = 2; k < n; k++) {
+            if (fds[k].revents == 0)
+                continue;
+            int client = owner[k];
+            if (net_read(&server.clients[client]) == 0) {
+                server_drop_client(client);
+                continue;
+            }
+
+            char *line;
+            bool overflow;
+            while (server.clients[client].fd >= 0
+                    && (line = net_line(&server.clients[client], &overflow)) != NULL)
+                server_command(client, line);
+            if (server.clients[client].fd >= 0 && overflow) {
+                net_send(server.clients[client].fd, "ERROR line too long\n");
+                server_drop_client(client);
+            }
+        }
+    }
+
+    /* Stop everything and wait for the workers to let go of it */
+    fprintf(log_out, "Shutting down\n");
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (server.clients[i].fd >= 0)
+            server_drop_client(i);
+    }
+    server_wait_jobs();
+
+    close(listen_fd);
+    if (strncmp(address, "unix:", 5) == 0)
+        unlink(address + 5);
+    close(server.wake[0]);
+    close(server.wake[1]);
+    return 0;
+}
 
-    /* We'll keep on working until a solution for our bitcoin block is found */
+/* Function: server_wait_jobs
+ * --------------------------
+ * Waits until every job in server.jobs has finished and been reported.
+ */
+void server_wait_jobs(void) {
     while (true) {
+        bool pending = false;
+        int i;
+        for (i = 0; i < MAX_ACTIVE_JOBS; i++)
+            pending = pending || server.jobs[i] != NULL;
+        if (!pending)
+            break;
 
-      pthread_mutex_lock(&task_mutex);
-      while (task_pointer == NULL && solution_found == false) {
-        //printf("thread %d is waiting for consumer\n", info->thread_id);
-        pthread_cond_wait(&task_ready, &task_mutex);
-      }
+        struct pollfd wake = { server.wake[0], POLLIN, 0 };
+        poll(&wake, 1, -1);
+        char drain[64];
+        while (read(server.wake[0], drain, sizeof(drain)) > 0)
+            ;
+        server_report_finished();
+    }
+}
+
+/* Function: server_command
+ * ------------------------
+ * Carries out one line from a client (see run_server()).
+ */
+void server_command(int client, char *line) {
+    int fd = server.clients[client].fd;
+    char *args = line + strcspn(line, " ");
+    if (*args != '\0')
+        *args++ = '\0';
+
+    int i;
+    if (strcmp(line, "SUBMIT") == 0 || strcmp(line, "REPLACE") == 0) {
+        uint32_t target[HASH_MAX_WORDS];
+        char *data;
+        const char *error = parse_job_line(args, target, &data);
+        if (error != NULL) {
+            net_send(fd, "ERROR %s\n", error);
+            return;
+        }
+
+        if (strcmp(line, "REPLACE") == 0) {
+            for (i = 0; i < MAX_ACTIVE_JOBS; i++) {
+                if (server.jobs[i] != NULL && server.jobs[i]->client == client)
+                    cancel_job(server.jobs[i]);
+            }
+        }
 
-        if (solution_found) {
-          //printf("Thread %d sees that a solution has been found\n", info->thread_id);
-          pthread_cond_signal(&task_staging);
-          pthread_mutex_unlock(&task_mutex);
+        for (i = 0; i < MAX_ACTIVE_JOBS && server.jobs[i] != NULL; i++)
+            ;
+        if (i == MAX_ACTIVE_JOBS) {
+            net_send(fd, "ERROR too many jobs\n");
+            return;
+        }
 
-            return NULL;
+        struct job *job = job_create(data, target);
+        job->id = ++server.last_id;
+        job->client = client;
+        job->on_finish = server_job_finished;
+        job->start_time = get_time();
+        server.jobs[i] = job;
+        net_send(fd, "QUEUED %lu\n", job->id);
+        submit_job(job);
+    } else if (strcmp(line, "CANCEL") == 0) {
+        char *end;
+        unsigned long id = strtoul(args, &end, 10);
+        for (i = 0; i < MAX_ACTIVE_JOBS; i++) {
+            if (server.jobs[i] != NULL && server.jobs[i]->id == id)
+                break;
         }
+        if (end == args || *end != '\0' || i == MAX_ACTIVE_JOBS) {
+            net_send(fd, "ERROR unknown job\n");
+            return;
+        }
+        cancel_job(server.jobs[i]);
+    } else {
+        net_send(fd, "ERROR unknown command\n");
+    }
+}
 
-        /* Copy over task */
-        task_nonces = task_pointer;
+/* Function: server_job_finished
+ * -----------------------------
+ * on_finish callback for daemon jobs: queues the job for run_server() to
+ * report, since only that thread writes to clients.
+ */
+void server_job_finished(struct job *job) {
+    pthread_mutex_lock(&pool_mutex);
+    job->next_finished = server.finished;
+    server.finished = job;
+    pthread_mutex_unlock(&pool_mutex);
 
-        /* Empty out our task_pointer so another thread can receive a task. */
-        task_pointer = NULL;
+    ssize_t n = write(server.wake[1], "j", 1);
+    (void) n;
+}
 
-        /* let main know to stage a new task */
-        pthread_cond_signal(&task_staging);
-        pthread_mutex_unlock(&task_mutex);
+/* Function: server_report_finished
+ * --------------------------------
+ * Sends the results of the jobs finished since the last call to their
+ * clients and frees them. A node tells its coordinator
+ * "FOUND id nonce hash hashes" for a solution, or "DONE id start end
+ * hashes" when it searched the whole range, and nothing if it was
+ * cancelled.
+ */
+void server_report_finished(void) {
+    pthread_mutex_lock(&pool_mutex);
+    struct job *job = server.finished;
+    server.finished = NULL;
+    pthread_mutex_unlock(&pool_mutex);
 
+    while (job != NULL) {
+        struct job *next = job->next_finished;
         int i;
-        for (i = 0; i < NONCES_PER_TASK; ++i) {
-            /* Convert the nonce to a string */
-            char buf[21];
-            sprintf(buf, "%llu", task_nonces[i]);
+        for (i = 0; i < MAX_ACTIVE_JOBS; i++) {
+            if (server.jobs[i] == job)
+                server.jobs[i] = NULL;
+        }
+
+        if (job->client >= 0 && server.node) {
+            int fd = server.clients[job->client].fd;
+            if (job->solver >= 0) {
+                net_send(fd, "FOUND %lu %llu %s %llu\n", job->id,
+                        (unsigned long long) job->nonce, job->solution_hash,
+                        (unsigned long long) job->hashes);
+            } else if (!job->cancelled) {
+                net_send(fd, "DONE %lu %llu %llu %llu\n", job->id,
+                        (unsigned long long) job->range_start,
+                        (unsigned long long) job->range_end,
+                        (unsigned long long) job->hashes);
+            }
+        } else if (job->client >= 0) {
+            int fd = server.clients[job->client].fd;
+            if (job->solver >= 0) {
+                net_send(fd, "SOLVED %lu %llu %s %llu %.3f\n", job->id,
+                        (unsigned long long) job->nonce, job->solution_hash,
+                        (unsigned long long) job->hashes,
+                        job->last_stop - job->start_time);
+            } else {
+                net_send(fd, "CANCELLED %lu\n", job->id);
+            }
+        }
+        job_free(job);
+        job = next;
+    }
+}
+
+/* Function: server_drop_client
+ * ----------------------------
+ * Closes a client connection and cancels the jobs it submitted.
+ */
+void server_drop_client(int client) {
+    int i;
+    for (i = 0; i < MAX_ACTIVE_JOBS; i++) {
+        if (server.jobs[i] != NULL && server.jobs[i]->client == client) {
+            server.jobs[i]->client = -1;
+            cancel_job(server.jobs[i]);
+        }
+    }
+    close(server.clients[client].fd);
+    server.clients[client].fd = -1;
+}
+
+/* Function: cancel_job
+ * --------------------
+ * Stops a job as if it had been solved, without a solution: workers drop
+ * its chunks and it finishes with solver still -1. Has no effect on a job
+ * that is already solved, other than setting cancelled (which only the
+ * main thread reads).
+ */
+void cancel_job(struct job *job) {
+    job->cancelled = true;
+    atomic_store(&job->solution_found, true);
+}
 
-            /* Create a new string by concatenating the block and nonce string.
-             * For example, if we have 'Hello World!' and '10', the new string
-             * is: 'Hello World!10' */
-            size_t str_size = strlen(buf) + strlen(bitcoin_block_data);
-            char *tmp_str = malloc(sizeof(char) * str_size + 1);
-            strcpy(tmp_str, bitcoin_block_data);
-            strcat(tmp_str, buf);
+/* Distributed mode. The coordinator hands every node RANGES_PER_NODE
+ * disjoint ranges of range_size nonces at a time, so a node has its next
+ * range queued before it runs out. A node is a daemon (run_node()) whose
+ * single client is the coordinator. */
+#define RANGES_PER_NODE 2
+#define MAX_NODES 64
 
-            /* Hash the temporary (combined) string */
-            uint8_t digest[20];
-            sha1sum(digest, tmp_str);
+struct node {
+    struct connection conn;  /* fd is -1 for a free slot */
+    struct range ranges[RANGES_PER_NODE];
+    int num_ranges;
+};
+
+/* The job a node is being given ranges of */
+unsigned long node_job_id;
+uint32_t node_target[HASH_MAX_WORDS];
+char *node_data;
 
-            /* Clean up the temporary string */
-            free(tmp_str);
+/* Function: run_node
+ * ------------------
+ * Mines ranges for a coordinator until it hangs up. The coordinator sends
+ *
+ *     JOB id difficulty block data   the job the following ranges are of
+ *     RANGE id start end             search nonces [start, end)
+ *     CANCEL id                      stop searching the job
+ *
+ * and gets the FOUND and DONE lines described in server_report_finished().
+ *
+ * fd: connection to the coordinator
+ * address: its address, for messages
+ *
+ * returns: 0, or EXIT_FAILURE if the node could not start
+ */
+int run_node(int fd, const char *address) {
+    int i;
+    server.node = true;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        server.clients[i].fd = -1;
+    server.clients[0].fd = fd;
+    if (pipe2(server.wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, server_signal);
+    signal(SIGTERM, server_signal);
+    fprintf(log_out, "Joined %s\n", address);
 
-            /* Take the front 32 bits of the hash (spit across four 8-bit
-             * unsigned integers and combine them */
-            uint32_t hash_front = 0;
-            hash_front |= digest[0] << 24;
-            hash_front |= digest[1] << 16;
-            hash_front |= digest[2] << 8;
-            hash_front |= digest[3];
+    while (!server_stopping) {
+        struct pollfd fds[2] = {
+            { server.wake[0], POLLIN, 0 },
+            { fd, POLLIN, 0 }
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
 
-            /* Check to see if we've found a solution to our block. We perform a
-             * bitwise AND operation and check to see if we get the same result
-             * back. */
-            if ((hash_front & difficulty_mask) == hash_front) {
-                solution_found = true;
-                info->nonce = task_nonces[i];
-                sha1tostring(info->solution_hash, digest);
+        if (fds[0].revents) {
+            char drain[64];
+            while (read(server.wake[0], drain, sizeof(drain)) > 0)
+                ;
+            server_report_finished();
+        }
 
-                // To wake up main from waiting
-                pthread_cond_signal(&task_staging);
-                return NULL;
+        if (fds[1].revents) {
+            if (net_read(&server.clients[0]) == 0) {
+                fprintf(log_out, "Coordinator closed the connection\n");
+                break;
+            }
+            char *line;
+            bool overflow;
+            while ((line = net_line(&server.clients[0], &overflow)) != NULL)
+                node_command(line);
+            if (overflow) {
+                fprintf(log_out, "Coordinator sent an overlong line\n");
+                break;
             }
         }
+    }
 
-        free(task_nonces);
-        info->num_inversions += NONCES_PER_TASK;
+    for (i = 0; i < MAX_ACTIVE_JOBS; i++) {
+        if (server.jobs[i] != NULL) {
+            server.jobs[i]->client = -1;
+            cancel_job(server.jobs[i]);
+        }
     }
+    server_wait_jobs();
 
-    return NULL;
+    close(fd);
+    close(server.wake[0]);
+    close(server.wake[1]);
+    free(node_data);
+    return 0;
 }
 
-void print_results(struct thread_info **threads, int num_threads, double total_time){
-  uint64_t total_inversions = 0;
+/* Function: node_command
+ * ----------------------
+ * Carries out one line from the coordinator (see run_node()). Malformed
+ * lines are logged and ignored.
+ */
+void node_command(char *line) {
+    char *args = line + strcspn(line, " ");
+    if (*args != '\0')
+        *args++ = '\0';
 
-  int i;
-  for(i = 0; i < num_threads; i++){
-    if(strlen(threads[i]->solution_hash) > 0){
-      printf("Solution found by thread %d:\n", threads[i]->thread_id);
-      printf("Nonce: %llu\n", threads[i]->nonce);
-      printf("Hash: %s\n", threads[i]->solution_hash);
+    char *end;
+    unsigned long id = strtoul(args, &end, 10);
+    if (end == args || (*end != ' ' && *end != '\0')) {
+        fprintf(log_out, "Bad line from coordinator: %s\n", line);
+        return;
+    }
+    args = end + (*end == ' ');
+
+    int i;
+    if (strcmp(line, "JOB") == 0) {
+        char *data;
+        const char *error = parse_job_line(args, node_target, &data);
+        if (error != NULL) {
+            fprintf(log_out, "Bad job from coordinator: %s\n", error);
+            return;
+        }
+        free(node_data);
+        node_data = strdup(data);
+        node_job_id = id;
+    } else if (strcmp(line, "RANGE") == 0) {
+        unsigned long long start, stop;
+        if (sscanf(args, "%llu %llu", &start, &stop) != 2 || start >= stop
+                || node_data == NULL || id != node_job_id) {
+            fprintf(log_out, "Bad range from coordinator: %s\n", args);
+            return;
+        }
+        for (i = 0; i < MAX_ACTIVE_JOBS && server.jobs[i] != NULL; i++)
+            ;
+        if (i == MAX_ACTIVE_JOBS) {
+            fprintf(log_out, "Too many ranges from coordinator\n");
+            return;
+        }
+
+        struct job *job = job_create(node_data, node_target);
+        job->id = id;
+        job->client = 0;
+        job->range_start = start;
+        job->range_end = stop;
+        job->on_finish = server_job_finished;
+        job->start_time = get_time();
+        server.jobs[i] = job;
+        submit_job(job);
+    } else if (strcmp(line, "CANCEL") == 0) {
+        for (i = 0; i < MAX_ACTIVE_JOBS; i++) {
+            if (server.jobs[i] != NULL && server.jobs[i]->id == id)
+                cancel_job(server.jobs[i]);
+        }
+    } else {
+        fprintf(log_out, "Unknown command from coordinator: %s\n", line);
+    }
+}
+
+/* Function: assign_range
+ * ----------------------
+ * Gives a node its next range: one given up by a node that dropped out if
+ * there is one, or else the next range_size nonces.
+ */
+static void assign_range(struct node *node, uint64_t *next_start,
+        struct range *orphans, int *num_orphans) {
+    struct range range;
+    if (*num_orphans > 0) {
+        range = orphans[--*num_orphans];
+    } else {
+        if (*next_start == UINT64_MAX)
+            return;
+        range.start = *next_start;
+        range.end = (UINT64_MAX - range.start < range_size)
+            ? UINT64_MAX : range.start + range_size;
+        *next_start = range.end;
+    }
+
+    node->ranges[node->num_ranges++] = range;
+    net_send(node->conn.fd, "RANGE 1 %llu %llu\n",
+            (unsigned long long) range.start, (unsigned long long) range.end);
+}
+
+/* Function: run_coordinator
+ * -------------------------
+ * Splits one job's nonces between the nodes that connect to address (see
+ * run_node()) until one of them finds a solution, then tells them all to
+ * stop and prints the result. The coordinator hashes nothing itself and
+ * checks every solution it is sent. Ranges held by a node that disconnects
+ * are handed to the next node that asks for work.
+ *
+ * returns: 0, or EXIT_FAILURE on bad arguments
+ */
+int run_coordinator(const char *address, const char *difficulty,
+        const char *data) {
+    uint32_t target[HASH_MAX_WORDS];
+    if (get_difficulty(difficulty, target) != 0) {
+        printf("ERROR: Invalid difficulty '%s'\n", difficulty);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(data, "") == 0 || strchr(data, '\n') != NULL) {
+        printf("ERROR: The block data must be a non-empty single line.\n");
+        return EXIT_FAILURE;
+    }
+
+    errno = 0;
+    int listen_fd = net_listen(address);
+    if (listen_fd < 0) {
+        printf("ERROR: Could not listen on '%s': %s\n", address,
+                errno ? strerror(errno) : "bad address");
+        return EXIT_FAILURE;
+    }
+
+    static struct node nodes[MAX_NODES];
+    struct range orphans[MAX_NODES * RANGES_PER_NODE];
+    int num_orphans = 0;
+    uint64_t next_start = 0;
+    uint64_t hashes = 0;
+    int i, j;
+    for (i = 0; i < MAX_NODES; i++)
+        nodes[i].conn.fd = -1;
+
+    if (pipe2(server.wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, server_signal);
+    signal(SIGTERM, server_signal);
+    printf("Coordinating on %s\n", address);
+    fflush(stdout);
+
+    double start_time = get_time();
+    int solver = -1;
+    unsigned long long nonce = 0;
+    char hash[41] = "";
+    while (solver < 0 && !server_stopping) {
+        struct pollfd fds[2 + MAX_NODES];
+        int owner[2 + MAX_NODES];
+        int n = 0;
+        fds[n].fd = server.wake[0];
+        fds[n].events = POLLIN;
+        owner[n++] = -1;
+        fds[n].fd = listen_fd;
+        fds[n].events = POLLIN;
+        owner[n++] = -1;
+        for (i = 0; i < MAX_NODES; i++) {
+            if (nodes[i].conn.fd >= 0) {
+                fds[n].fd = nodes[i].conn.fd;
+                fds[n].events = POLLIN;
+                owner[n++] = i;
+            }
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[1].revents) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            for (i = 0; fd >= 0 && i < MAX_NODES && nodes[i].conn.fd >= 0; i++)
+                ;
+            if (fd >= 0 && i == MAX_NODES) {
+                close(fd);
+            } else if (fd >= 0) {
+                memset(&nodes[i], 0, sizeof(struct node));
+                nodes[i].conn.fd = fd;
+                net_send(fd, "JOB 1 %s %s\n", difficulty, data);
+                while (nodes[i].num_ranges < RANGES_PER_NODE && next_start < UINT64_MAX)
+                    assign_range(&nodes[i], &next_start, orphans, &num_orphans);
+                printf("Node %d joined\n", i);
+                fflush(stdout);
+            }
+        }
+
+        int k;
+        for (k = 2; k < n && solver < 0; k++) {
+            if (fds[k].revents == 0)
+                continue;
+            struct node *node = &nodes[owner[k]];
+            bool drop = net_read(&node->conn) == 0;
+
+            char *line;
+            bool overflow = false;
+            while (!drop && solver < 0
+                    && (line = net_line(&node->conn, &overflow)) != NULL) {
+                unsigned long id;
+                unsigned long long start, stop, count, found;
+                char found_hash[41];
+                if (sscanf(line, "DONE %lu %llu %llu %llu", &id, &start, &stop, &count) == 4) {
+                    for (j = 0; j < node->num_ranges; j++) {
+                        if (node->ranges[j].start == start && node->ranges[j].end == stop)
+                            break;
+                    }
+                    if (j == node->num_ranges)
+                        continue; /* not one of its ranges */
+                    node->ranges[j] = node->ranges[--node->num_ranges];
+                    hashes += count;
+                    assign_range(node, &next_start, orphans, &num_orphans);
+                } else if (sscanf(line, "FOUND %lu %llu %40s %llu", &id, &found,
+                            found_hash, &count) == 4) {
+                    hashes += count;
+                    if (verify_solution(data, target, found, found_hash)) {
+                        solver = owner[k];
+                        nonce = found;
+                        strcpy(hash, found_hash);
+                    } else {
+                        printf("Node %d sent a wrong solution: %llu %s\n",
+                                owner[k], found, found_hash);
+                    }
+                } else {
+                    printf("Node %d sent: %s\n", owner[k], line);
+                }
+            }
+            drop = drop || overflow;
+
+            if (drop) {
+                /* Somebody else gets to finish its ranges */
+                for (j = 0; j < node->num_ranges; j++)
+                    orphans[num_orphans++] = node->ranges[j];
+                node->num_ranges = 0;
+                close(node->conn.fd);
+                node->conn.fd = -1;
+                printf("Node %d left\n", owner[k]);
+                fflush(stdout);
+
+                for (i = 0; i < MAX_NODES && num_orphans > 0; i++) {
+                    while (nodes[i].conn.fd >= 0 && num_orphans > 0
+                            && nodes[i].num_ranges < RANGES_PER_NODE)
+                        assign_range(&nodes[i], &next_start, orphans, &num_orphans);
+                }
+            }
+        }
     }
-    total_inversions += threads[i]->num_inversions;
+
+    double end_time = get_time();
+    for (i = 0; i < MAX_NODES; i++) {
+        if (nodes[i].conn.fd >= 0) {
+            net_send(nodes[i].conn.fd, "CANCEL 1\n");
+            close(nodes[i].conn.fd);
+        }
+    }
+    close(listen_fd);
+    if (strncmp(address, "unix:", 5) == 0)
+        unlink(address + 5);
+    close(server.wake[0]);
+    close(server.wake[1]);
+
+    if (solver >= 0) {
+        printf("Solution found by node %d:\n", solver);
+        printf("Nonce: %llu\n", nonce);
+        printf("Hash: %s\n", hash);
+    }
+    printf("%llu hashes in %.2fs (%.2f hashes/sec)\n",
+            (unsigned long long) hashes, end_time - start_time,
+            hashes / (end_time - start_time));
+    return 0;
+}
+
+/* Function: verify_solution
+ * -------------------------
+ * Checks a reported solution from scratch: hash is the engine's hash of
+ * data followed by the decimal nonce, and meets target.
+ */
+bool verify_solution(const char *data, const uint32_t target[HASH_MAX_WORDS],
+        uint64_t nonce, const char *hash) {
+    size_t len = strlen(data);
+    char *message = malloc(len + 21);
+    sprintf(message, "%s%llu", data, (unsigned long long) nonce);
+
+    uint32_t words[HASH_MAX_WORDS];
+    char expected[8 * HASH_MAX_WORDS + 1];
+    engine.digest(words, message, strlen(message));
+    hash_tostring(expected, words, engine.words);
+    free(message);
+
+    return strcmp(expected, hash) == 0 && meets_target(words, target);
+}
+
+void print_results(const struct job *job, double total_time){
+  if(job->solution_found){
+    printf("Solution found by thread %d:\n", job->solver);
+    printf("Nonce: %llu\n", (unsigned long long) job->nonce);
+    printf("Hash: %s\n", job->solution_hash);
   }
 
+  uint64_t hashes = job->hashes;
   printf("%llu hashes in %.2fs (%.2f hashes/sec)\n",
-          total_inversions, total_time, total_inversions / total_time);
+          (unsigned long long) hashes, total_time, hashes / total_time);
+  printf("Task size: %u nonces (%s)\n", (unsigned int) shared.nonces_per_task,
+          task_size_auto ? "auto" : "fixed");
+  if(job->solution_found)
+    printf("Time to stop after solution: %.3f ms\n",
+            (job->last_stop - job->solution_time) * 1000);
+  printf("Peak RSS: %.1f MB\n", peak_rss() / 1048576.0);
+#ifdef MINE_OPENCL
+  if (num_gpu_devices > 0)
+    gpu_print_rates(total_time);
+#endif
+#ifdef MINE_PROFILE
+  print_profile();
+#endif
+}
+
+#ifdef MINE_PROFILE
+/* Function: print_profile
+ * -----------------------
+ * Profiling build: prints how each worker's ticks split between the
+ * phases so far, and ticks per hash not counting idle time.
+ */
+void print_profile(void) {
+    uint64_t all[NUM_PHASES] = { 0 };
+    uint64_t all_hashes = 0;
+    unsigned int i;
+    int p;
+    printf("Profile (ticks):%*s", 4, "");
+    for (p = 0; p < NUM_PHASES; p++)
+        printf(" %7s", profile_phase_names[p]);
+    printf(" %10s\n", "ticks/hash");
+
+    for (i = 0; i <= num_workers; i++) {
+        const uint64_t *ticks = all;
+        uint64_t hashes = all_hashes;
+        if (i < num_workers) {
+            ticks = workers[i]->profile;
+            hashes = workers[i]->num_inversions;
+            for (p = 0; p < NUM_PHASES; p++)
+                all[p] += ticks[p];
+            all_hashes += hashes;
+            printf("  thread %-11u", i);
+        } else {
+            printf("  %-18s", "all");
+        }
+
+        uint64_t total = 0;
+        for (p = 0; p < NUM_PHASES; p++)
+            total += ticks[p];
+        for (p = 0; p < NUM_PHASES; p++)
+            printf(" %6.1f%%", total ? ticks[p] * 100.0 / total : 0);
+        printf(" %10.1f\n", hashes ? (double) (total - ticks[PHASE_IDLE]) / hashes : 0);
+    }
+}
+#endif
+
+/* Function: print_found
+ * ---------------------
+ * Find-all mode: merges the workers' found_lists once they have stopped
+ * and prints one 'nonce hash' line per solution, by nonce, or with top_k
+ * set the best top_k, best first.
+ */
+void print_found(const struct job *job, double total_time) {
+    size_t count = 0;
+    unsigned int i;
+    for (i = 0; i < num_workers; i++)
+        count += workers[i]->found.count;
+
+    struct found *all = malloc(sizeof(struct found) * (count ? count : 1));
+    size_t n = 0;
+    for (i = 0; i < num_workers; i++) {
+        memcpy(all + n, workers[i]->found.items,
+                sizeof(struct found) * workers[i]->found.count);
+        n += workers[i]->found.count;
+    }
+
+    if (top_k > 0) {
+        qsort(all, count, sizeof(struct found), compare_found);
+        if (count > top_k)
+            count = top_k;
+    } else {
+        qsort(all, count, sizeof(struct found), compare_found_nonce);
+    }
+
+    if (job->solution_found)
+        printf("Interrupted: only part of the range was searched\n");
+    printf("%s%zu solution%s in nonces %llu to %llu:\n",
+            top_k > 0 ? "Best " : "", count, count == 1 ? "" : "s",
+            (unsigned long long) job->range_start,
+            (unsigned long long) job->range_end - 1);
+    size_t s;
+    for (s = 0; s < count; s++) {
+        char hash[8 * HASH_MAX_WORDS + 1];
+        hash_tostring(hash, all[s].hash, engine.words);
+        printf("%llu %s\n", (unsigned long long) all[s].nonce, hash);
+    }
+    free(all);
+
+    uint64_t hashes = job->hashes;
+    printf("%llu hashes in %.2fs (%.2f hashes/sec)\n",
+            (unsigned long long) hashes, total_time, hashes / total_time);
+    printf("Peak RSS: %.1f MB\n", peak_rss() / 1048576.0);
 }
+
+#ifdef MINE_OPENCL
+#include "gpu.c"
+#endif
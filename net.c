@@ -0,0 +1,248 @@
+/**
+ * net.c
+ *
+ * Sockets for the daemon and distributed modes. Addresses are written
+ * "unix:PATH" for a Unix domain socket, "tcp:PORT" to listen on every
+ * interface, or "tcp:HOST:PORT". Connections speak a line-based text
+ * protocol, so this also buffers incoming bytes and hands them out a line
+ * at a time.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Longest line accepted from a peer, including the newline */
+#define NET_LINE_MAX 8192
+
+/* Bytes received on a connection that have not been handed out yet */
+struct connection {
+    int fd;
+    char in[NET_LINE_MAX];
+    size_t in_len;
+    size_t consumed;  /* length of the line returned last */
+};
+
+int net_listen(const char *address);
+int net_connect(const char *address);
+int net_read(struct connection *conn);
+char *net_line(struct connection *conn, bool *overflow);
+int net_send(int fd, const char *format, ...);
+
+/* Function: net_resolve
+ * ---------------------
+ * Looks up a "tcp:[HOST:]PORT" address.
+ *
+ * returns: the address list from getaddrinfo(), or NULL
+ */
+static struct addrinfo *net_resolve(const char *address, bool passive) {
+    char host[256] = "";
+    const char *port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon != NULL) {
+        size_t len = colon - address;
+        if (len >= sizeof(host))
+            return NULL;
+        memcpy(host, address, len);
+        host[len] = '\0';
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    struct addrinfo *list;
+    if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &list) != 0)
+        return NULL;
+    return list;
+}
+
+/* Function: net_listen
+ * --------------------
+ * Opens a listening socket. An old Unix socket file at the same path is
+ * removed first.
+ *
+ * address: "unix:PATH" or "tcp:[HOST:]PORT"
+ *
+ * returns: the socket, or -1 (with errno set where there is one)
+ */
+int net_listen(const char *address) {
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(addr.sun_path))
+            return -1;
+        strcpy(addr.sun_path, address + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        unlink(addr.sun_path);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else if (strncmp(address, "tcp:", 4) == 0) {
+        struct addrinfo *list = net_resolve(address + 4, true);
+        struct addrinfo *ai;
+        for (ai = list; ai != NULL; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            int yes = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        if (list != NULL)
+            freeaddrinfo(list);
+        if (fd < 0)
+            return -1;
+    } else {
+        return -1;
+    }
+
+    if (listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Function: net_connect
+ * ---------------------
+ * Connects to a listening socket.
+ *
+ * address: "unix:PATH" or "tcp:HOST:PORT"
+ *
+ * returns: the socket, or -1 (with errno set where there is one)
+ */
+int net_connect(const char *address) {
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(addr.sun_path))
+            return -1;
+        strcpy(addr.sun_path, address + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (strncmp(address, "tcp:", 4) != 0)
+        return -1;
+    struct addrinfo *list = net_resolve(address + 4, false);
+    struct addrinfo *ai;
+    for (ai = list; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    if (list != NULL)
+        freeaddrinfo(list);
+    return fd;
+}
+
+/* Function: net_read
+ * ------------------
+ * Reads whatever has arrived on a connection into its buffer.
+ *
+ * returns: bytes read, or 0 once the peer has closed the connection or on
+ *          an error
+ */
+int net_read(struct connection *conn) {
+    if (conn->consumed > 0) {
+        memmove(conn->in, conn->in + conn->consumed, conn->in_len - conn->consumed);
+        conn->in_len -= conn->consumed;
+        conn->consumed = 0;
+    }
+
+    ssize_t n = read(conn->fd, conn->in + conn->in_len,
+            sizeof(conn->in) - conn->in_len);
+    if (n <= 0)
+        return 0;
+    conn->in_len += n;
+    return n;
+}
+
+/* Function: net_line
+ * ------------------
+ * Returns the next complete line on a connection, without its line ending.
+ * The line stays valid until the next call to net_line() or net_read().
+ *
+ * overflow: set to true if the buffer is full without a complete line, in
+ *           which case the connection can't make progress
+ *
+ * returns: the line, or NULL if there is no complete line yet
+ */
+char *net_line(struct connection *conn, bool *overflow) {
+    if (conn->consumed > 0) {
+        memmove(conn->in, conn->in + conn->consumed, conn->in_len - conn->consumed);
+        conn->in_len -= conn->consumed;
+        conn->consumed = 0;
+    }
+
+    char *newline = memchr(conn->in, '\n', conn->in_len);
+    *overflow = newline == NULL && conn->in_len == sizeof(conn->in);
+    if (newline == NULL)
+        return NULL;
+
+    conn->consumed = newline - conn->in + 1;
+    *newline = '\0';
+    if (newline > conn->in && newline[-1] == '\r')
+        newline[-1] = '\0';
+    return conn->in;
+}
+
+/* Function: net_send
+ * ------------------
+ * Formats a line and writes all of it to a socket. A peer that has gone
+ * away does not raise SIGPIPE.
+ *
+ * returns: 0, or -1 if the write failed
+ */
+int net_send(int fd, const char *format, ...) {
+    char line[NET_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0 || len >= sizeof(line))
+        return -1;
+
+    int sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, line + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
@@ -28,10 +28,80 @@ int SHA1Input(SHA1Context *, const uint8_t *, unsigned int);
 int SHA1Result(SHA1Context *, uint8_t Message_Digest[SHA1HashSize]);
 void SHA1PadMessage(SHA1Context *);
 void SHA1ProcessMessageBlock(SHA1Context *);
+void SHA1CompressWords(uint32_t Intermediate_Hash[SHA1HashSize/4],
+        const uint32_t Words[16]);
+uint32_t SHA1CompressFront(const uint32_t Intermediate_Hash[SHA1HashSize/4],
+        const uint32_t Words[16]);
 
 #define SHA1CircularShift(bits,word) \
                 (((word) << (bits)) | ((word) >> (32-(bits))))
 
+/* Round functions and fully unrolled rounds used by SHA1CompressWords. The
+ * message schedule is kept in a rolling 16-word window. */
+#define SHA1Ch(b,c,d)     (((b) & (c)) | ((~(b)) & (d)))
+#define SHA1Parity(b,c,d) ((b) ^ (c) ^ (d))
+#define SHA1Maj(b,c,d)    (((b) & (c)) | ((b) & (d)) | ((c) & (d)))
+
+#define SHA1Schedule(t) ((t) < 16 ? W[(t) & 15] : \
+        (W[(t) & 15] = SHA1CircularShift(1, W[((t) - 3) & 15] ^ \
+            W[((t) - 8) & 15] ^ W[((t) - 14) & 15] ^ W[(t) & 15])))
+
+#define SHA1Round(a,b,c,d,e,f,k,t) \
+        e += SHA1CircularShift(5,a) + f(b,c,d) + (k) + SHA1Schedule(t); \
+        b = SHA1CircularShift(30,b)
+
+#define SHA1Round5(f,k,t) \
+        SHA1Round(A,B,C,D,E,f,k,(t));     \
+        SHA1Round(E,A,B,C,D,f,k,(t) + 1); \
+        SHA1Round(D,E,A,B,C,f,k,(t) + 2); \
+        SHA1Round(C,D,E,A,B,f,k,(t) + 3); \
+        SHA1Round(B,C,D,E,A,f,k,(t) + 4)
+
+#define SHA1Round20(f,k,t) \
+        SHA1Round5(f,k,(t));      \
+        SHA1Round5(f,k,(t) + 5);  \
+        SHA1Round5(f,k,(t) + 10); \
+        SHA1Round5(f,k,(t) + 15)
+
+/* Rounds 0-19 entered part way, at round `from` (0-15), for a block whose
+ * leading words are the same in every message so the rounds over them can
+ * be run once for all of them. SHA1Enter() first loads the state as it
+ * stands after `from` rounds, s[0] to s[4] in the usual a to e order, into
+ * whichever of A to E round `from` reads them from. Words before `from`
+ * are never read here; the schedule still needs all 16 in W. */
+#define SHA1Enter(from, s) \
+    switch ((from) % 5) { \
+    case 0: A = s[0]; B = s[1]; C = s[2]; D = s[3]; E = s[4]; break; \
+    case 1: E = s[0]; A = s[1]; B = s[2]; C = s[3]; D = s[4]; break; \
+    case 2: D = s[0]; E = s[1]; A = s[2]; B = s[3]; C = s[4]; break; \
+    case 3: C = s[0]; D = s[1]; E = s[2]; A = s[3]; B = s[4]; break; \
+    default: B = s[0]; C = s[1]; D = s[2]; E = s[3]; A = s[4]; break; \
+    }
+
+#define SHA1Round20From(from) \
+    switch (from) { \
+    case 0:  SHA1Round(A,B,C,D,E,SHA1Ch,0x5A827999,0); \
+    case 1:  SHA1Round(E,A,B,C,D,SHA1Ch,0x5A827999,1); \
+    case 2:  SHA1Round(D,E,A,B,C,SHA1Ch,0x5A827999,2); \
+    case 3:  SHA1Round(C,D,E,A,B,SHA1Ch,0x5A827999,3); \
+    case 4:  SHA1Round(B,C,D,E,A,SHA1Ch,0x5A827999,4); \
+    case 5:  SHA1Round(A,B,C,D,E,SHA1Ch,0x5A827999,5); \
+    case 6:  SHA1Round(E,A,B,C,D,SHA1Ch,0x5A827999,6); \
+    case 7:  SHA1Round(D,E,A,B,C,SHA1Ch,0x5A827999,7); \
+    case 8:  SHA1Round(C,D,E,A,B,SHA1Ch,0x5A827999,8); \
+    case 9:  SHA1Round(B,C,D,E,A,SHA1Ch,0x5A827999,9); \
+    case 10: SHA1Round(A,B,C,D,E,SHA1Ch,0x5A827999,10); \
+    case 11: SHA1Round(E,A,B,C,D,SHA1Ch,0x5A827999,11); \
+    case 12: SHA1Round(D,E,A,B,C,SHA1Ch,0x5A827999,12); \
+    case 13: SHA1Round(C,D,E,A,B,SHA1Ch,0x5A827999,13); \
+    case 14: SHA1Round(B,C,D,E,A,SHA1Ch,0x5A827999,14); \
+    case 15: SHA1Round(A,B,C,D,E,SHA1Ch,0x5A827999,15); \
+    } \
+    SHA1Round(E,A,B,C,D,SHA1Ch,0x5A827999,16); \
+    SHA1Round(D,E,A,B,C,SHA1Ch,0x5A827999,17); \
+    SHA1Round(C,D,E,A,B,SHA1Ch,0x5A827999,18); \
+    SHA1Round(B,C,D,E,A,SHA1Ch,0x5A827999,19)
+
 
 int SHA1Reset(SHA1Context *context) {
     if (!context) {
@@ -110,67 +180,78 @@ int SHA1Input(SHA1Context *context,
 }
 
 void SHA1ProcessMessageBlock(SHA1Context *context) {
-    const uint32_t K[] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
     int t;
-    uint32_t temp;
-    uint32_t W[80];
-    uint32_t A, B, C, D, E;
+    uint32_t W[16];
     for(t = 0; t < 16; t++) {
         W[t] = context->Message_Block[t * 4] << 24;
         W[t] |= context->Message_Block[t * 4 + 1] << 16;
         W[t] |= context->Message_Block[t * 4 + 2] << 8;
         W[t] |= context->Message_Block[t * 4 + 3];
     }
-    for(t = 16; t < 80; t++) {
-       W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }
-    A = context->Intermediate_Hash[0];
-    B = context->Intermediate_Hash[1];
-    C = context->Intermediate_Hash[2];
-    D = context->Intermediate_Hash[3];
-    E = context->Intermediate_Hash[4];
-    for(t = 0; t < 20; t++) {
-        temp = SHA1CircularShift(5,A) +
-                ((B & C) | ((~B) & D)) + E + W[t] + K[0];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
-    for(t = 20; t < 40; t++) {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
-    for(t = 40; t < 60; t++) {
-        temp = SHA1CircularShift(5,A) +
-               ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
-    for(t = 60; t < 80; t++) {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
-    context->Intermediate_Hash[0] += A;
-    context->Intermediate_Hash[1] += B;
-    context->Intermediate_Hash[2] += C;
-    context->Intermediate_Hash[3] += D;
-    context->Intermediate_Hash[4] += E;
+    SHA1CompressWords(context->Intermediate_Hash, W);
     context->Message_Block_Index = 0;
 }
 
+/* Function: SHA1CompressWords
+ * ---------------------------
+ * Runs the 80 rounds over one block that has already been split into
+ * big-endian 32-bit words, with no byte handling or bookkeeping.
+ *
+ * Intermediate_Hash: chaining state, updated in place
+ * Words: the 16 message words of the block
+ */
+void SHA1CompressWords(uint32_t Intermediate_Hash[SHA1HashSize/4],
+        const uint32_t Words[16]) {
+    uint32_t W[16];
+    uint32_t A, B, C, D, E;
+    memcpy(W, Words, sizeof(W));
+    A = Intermediate_Hash[0];
+    B = Intermediate_Hash[1];
+    C = Intermediate_Hash[2];
+    D = Intermediate_Hash[3];
+    E = Intermediate_Hash[4];
+    SHA1Round20(SHA1Ch,     0x5A827999, 0);
+    SHA1Round20(SHA1Parity, 0x6ED9EBA1, 20);
+    SHA1Round20(SHA1Maj,    0x8F1BBCDC, 40);
+    SHA1Round20(SHA1Parity, 0xCA62C1D6, 60);
+    Intermediate_Hash[0] += A;
+    Intermediate_Hash[1] += B;
+    Intermediate_Hash[2] += C;
+    Intermediate_Hash[3] += D;
+    Intermediate_Hash[4] += E;
+}
+
+/* Function: SHA1CompressFront
+ * ---------------------------
+ * Test-only version of SHA1CompressWords() for the last block of a message:
+ * returns just the first word of the resulting hash and leaves the state
+ * alone. Word A comes out of the very last round, so all 80 rounds still
+ * run, but the other four state words are never finished or stored and the
+ * compiler drops the work that only feeds them (the final rotations of B).
+ *
+ * Intermediate_Hash: chaining state before the block
+ * Words: the 16 message words of the block
+ *
+ * returns: the front 32 bits of the digest
+ */
+uint32_t SHA1CompressFront(const uint32_t Intermediate_Hash[SHA1HashSize/4],
+        const uint32_t Words[16]) {
+    uint32_t W[16];
+    uint32_t A, B, C, D, E;
+    memcpy(W, Words, sizeof(W));
+    A = Intermediate_Hash[0];
+    B = Intermediate_Hash[1];
+    C = Intermediate_Hash[2];
+    D = Intermediate_Hash[3];
+    E = Intermediate_Hash[4];
+    SHA1Round20(SHA1Ch,     0x5A827999, 0);
+    SHA1Round20(SHA1Parity, 0x6ED9EBA1, 20);
+    SHA1Round20(SHA1Maj,    0x8F1BBCDC, 40);
+    SHA1Round20(SHA1Parity, 0xCA62C1D6, 60);
+    (void) B; (void) C; (void) D; (void) E;
+    return Intermediate_Hash[0] + A;
+}
+
 void SHA1PadMessage(SHA1Context *context) {
     if (context->Message_Block_Index > 55) {
         context->Message_Block[context->Message_Block_Index++] = 0x80;
@@ -205,6 +286,25 @@ void sha1sum(uint8_t digest[], char *data) {
     SHA1Result(&sha, digest);
 }
 
+/* Function: sha1midstate
+ * ----------------------
+ * Absorbs every full 64-byte block of data into a fresh context so it can be
+ * reused as the starting point for many messages sharing the same prefix.
+ *
+ * midstate: context to initialize
+ * data: message prefix
+ * len: length of data in bytes
+ *
+ * returns: number of bytes absorbed (a multiple of 64); the remaining
+ *          len % 64 bytes must be fed along with each message's tail
+ */
+size_t sha1midstate(SHA1Context *midstate, const char *data, size_t len) {
+    size_t absorbed = len - (len % 64);
+    SHA1Reset(midstate);
+    SHA1Input(midstate, (const unsigned char *) data, absorbed);
+    return absorbed;
+}
+
 void sha1tostring(char hash_str[], uint8_t digest[]) {
     int i;
     for(i = 0; i < 20 ; ++i) {
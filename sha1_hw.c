@@ -0,0 +1,189 @@
+/**
+ * sha1_hw.c
+ *
+ * SHA-1 compression using the hardware SHA instructions found on recent x86
+ * (Intel SHA extensions) and ARMv8 (crypto extensions) CPUs. The functions
+ * are drop-in replacements for SHA1CompressWords() and SHA1CompressFront()
+ * and are only called after sha1_hw_available() has confirmed the CPU
+ * supports them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+typedef void (*sha1_compress_fn)(uint32_t Intermediate_Hash[5],
+        const uint32_t Words[16]);
+typedef uint32_t (*sha1_front_fn)(const uint32_t Intermediate_Hash[5],
+        const uint32_t Words[16]);
+
+bool sha1_hw_available(void);
+uint32_t sha1_front_hw(const uint32_t Intermediate_Hash[5], const uint32_t Words[16]);
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define SHA1_HW_NAME "sha-ni"
+
+/* Four rounds of the Intel SHA-1 schedule. E runs the rounds, F saves ABCD
+ * for the next step, and the message registers rotate through M[k % 4]. */
+#define SHANI_STEP(k, E, F, func)                                            \
+    E = _mm_sha1nexte_epu32(E, M[(k) % 4]);                                  \
+    F = ABCD;                                                                \
+    if ((k) >= 3 && (k) <= 18)                                               \
+        M[((k) + 1) % 4] = _mm_sha1msg2_epu32(M[((k) + 1) % 4], M[(k) % 4]); \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E, func);                               \
+    if ((k) >= 1 && (k) <= 16)                                               \
+        M[((k) + 3) % 4] = _mm_sha1msg1_epu32(M[((k) + 3) % 4], M[(k) % 4]); \
+    if ((k) >= 2 && (k) <= 17)                                               \
+        M[((k) + 2) % 4] = _mm_xor_si128(M[((k) + 2) % 4], M[(k) % 4])
+
+/* Function: sha1_compress_hw
+ * --------------------------
+ * SHA1CompressWords() on the Intel SHA extensions.
+ */
+__attribute__((target("sha,sse4.1")))
+void sha1_compress_hw(uint32_t Intermediate_Hash[5], const uint32_t Words[16]) {
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+    __m128i M[4];
+    int i;
+
+    ABCD = _mm_loadu_si128((const __m128i *) Intermediate_Hash);
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    E0 = _mm_set_epi32(Intermediate_Hash[4], 0, 0, 0);
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    /* The words are already in host order, so only the lane order needs
+     * reversing (the first word goes in the high lane) */
+    for (i = 0; i < 4; i++) {
+        M[i] = _mm_loadu_si128((const __m128i *) (Words + 4 * i));
+        M[i] = _mm_shuffle_epi32(M[i], 0x1B);
+    }
+
+    /* Rounds 0-3 add the first words to E directly */
+    E0 = _mm_add_epi32(E0, M[0]);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+    SHANI_STEP(1, E1, E0, 0);
+    SHANI_STEP(2, E0, E1, 0);
+    SHANI_STEP(3, E1, E0, 0);
+    SHANI_STEP(4, E0, E1, 0);
+    SHANI_STEP(5, E1, E0, 1);
+    SHANI_STEP(6, E0, E1, 1);
+    SHANI_STEP(7, E1, E0, 1);
+    SHANI_STEP(8, E0, E1, 1);
+    SHANI_STEP(9, E1, E0, 1);
+    SHANI_STEP(10, E0, E1, 2);
+    SHANI_STEP(11, E1, E0, 2);
+    SHANI_STEP(12, E0, E1, 2);
+    SHANI_STEP(13, E1, E0, 2);
+    SHANI_STEP(14, E0, E1, 2);
+    SHANI_STEP(15, E1, E0, 3);
+    SHANI_STEP(16, E0, E1, 3);
+    SHANI_STEP(17, E1, E0, 3);
+    SHANI_STEP(18, E0, E1, 3);
+    SHANI_STEP(19, E1, E0, 3);
+
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    _mm_storeu_si128((__m128i *) Intermediate_Hash, ABCD);
+    Intermediate_Hash[4] = _mm_extract_epi32(E0, 3);
+}
+
+bool sha1_hw_available(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return false;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ebx & bit_SHA) != 0;
+}
+
+#elif defined(__aarch64__) && defined(__linux__)
+
+#define SHA1_HW_NAME "armv8-sha1"
+
+/* Function: sha1_compress_hw
+ * --------------------------
+ * SHA1CompressWords() on the ARMv8 crypto extensions.
+ */
+__attribute__((target("+crypto")))
+void sha1_compress_hw(uint32_t Intermediate_Hash[5], const uint32_t Words[16]) {
+    const uint32_t K[] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t ABCD, ABCD_SAVE, TMP;
+    uint32x4_t M[4];
+    uint32_t E, E_NEXT, E_SAVE;
+    int k;
+
+    ABCD = vld1q_u32(Intermediate_Hash);
+    E = Intermediate_Hash[4];
+    ABCD_SAVE = ABCD;
+    E_SAVE = E;
+
+    for (k = 0; k < 4; k++)
+        M[k] = vld1q_u32(Words + 4 * k);
+
+    /* Four rounds per step; from step 4 on, M[k % 4] is recomputed from the
+     * previous four schedule vectors before it is used */
+    for (k = 0; k < 20; k++) {
+        if (k >= 4) {
+            M[k % 4] = vsha1su1q_u32(vsha1su0q_u32(M[k % 4],
+                        M[(k + 1) % 4], M[(k + 2) % 4]), M[(k + 3) % 4]);
+        }
+        TMP = vaddq_u32(M[k % 4], vdupq_n_u32(K[k / 5]));
+        E_NEXT = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+        if (k < 5)
+            ABCD = vsha1cq_u32(ABCD, E, TMP);
+        else if (k >= 10 && k < 15)
+            ABCD = vsha1mq_u32(ABCD, E, TMP);
+        else
+            ABCD = vsha1pq_u32(ABCD, E, TMP);
+        E = E_NEXT;
+    }
+
+    ABCD = vaddq_u32(ABCD, ABCD_SAVE);
+    vst1q_u32(Intermediate_Hash, ABCD);
+    Intermediate_Hash[4] = E + E_SAVE;
+}
+
+bool sha1_hw_available(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+
+#else
+
+#define SHA1_HW_NAME NULL
+
+void sha1_compress_hw(uint32_t Intermediate_Hash[5], const uint32_t Words[16]) {
+    SHA1CompressWords(Intermediate_Hash, Words);
+}
+
+bool sha1_hw_available(void) {
+    return false;
+}
+
+#endif
+
+/* Function: sha1_front_hw
+ * -----------------------
+ * SHA1CompressFront() on the hardware backend. The instructions produce all
+ * state words together anyway, so only the final extraction is skipped.
+ */
+uint32_t sha1_front_hw(const uint32_t Intermediate_Hash[5], const uint32_t Words[16]) {
+    uint32_t state[5];
+    memcpy(state, Intermediate_Hash, sizeof(state));
+    sha1_compress_hw(state, Words);
+    return state[0];
+}
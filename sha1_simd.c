@@ -0,0 +1,349 @@
+/**
+ * sha1_simd.c
+ *
+ * Multi-buffer SHA-1: hashes several independent messages at once, one per
+ * vector lane. The kernels are written with GCC vector extensions and the
+ * round macros from sha1.c, then compiled once per instruction set with
+ * target attributes so a single binary can pick the widest kernel the CPU
+ * supports at runtime. If the CPU also has hardware SHA-1 instructions
+ * (sha1_hw.c), a short calibration decides which of the two is faster,
+ * unless a kernel is asked for by name.
+ *
+ * Lane layout: word t of tail block b for lane j lives at
+ *     words[(b * 16 + t) * lanes + j]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define SHA1_MAX_LANES 16
+
+typedef uint32_t (*sha1_lanes_fn)(const uint32_t midstate[5],
+        const uint32_t *words, int nblocks, uint32_t limit);
+
+/* The part of a hash that is the same for every tail in a scan: the
+ * chaining state through the blocks in front of the first word that
+ * differs between tails, and the working state after the rounds of that
+ * block that come before it. Sized for any engine's state. */
+struct scan_prefix {
+    uint32_t chain[8];  /* state before block `block` */
+    uint32_t state[8];  /* a, b, c, ... after `round` rounds of it */
+    int block;
+    int round;
+    int nblocks;
+};
+
+typedef uint32_t (*sha1_lanes_from_fn)(const struct scan_prefix *prefix,
+        const uint32_t *words, uint32_t limit);
+
+struct sha1_kernel {
+    const char *name;
+    int lanes;
+    sha1_lanes_fn scan;         /* NULL for one-at-a-time hashing */
+    sha1_lanes_from_fn scan_from;  /* scan, picking up from a prefix */
+    sha1_compress_fn compress;  /* single-block compression */
+    sha1_front_fn front;        /* front word only, for the last block */
+};
+
+int sha1_select_kernel(const char *name, struct sha1_kernel *kernel);
+void sha1_scan_prefix(struct scan_prefix *prefix, const uint32_t midstate[5],
+        const uint32_t *words, int nblocks, int first_word);
+
+/* Defines a kernel that hashes `lanes` tails starting from a shared midstate
+ * and returns a bitmask of the lanes whose front word is at most limit.
+ * Tails are one or two blocks long, and the body is expanded once for each
+ * with nblocks a constant, so the block loop and its early exit fold away;
+ * the call picks between them with a branch that only flips when a job's
+ * nonces gain the digit that spills into a second block.
+ *
+ * name##_from is the same kernel started from a scan_prefix built by
+ * sha1_scan_prefix(): blocks before prefix->block are skipped, and that
+ * block jumps straight to round prefix->round. */
+#define SHA1_LANES_KERNEL(name, attr, lanes)                                 \
+static inline __attribute__((always_inline)) attr uint32_t                   \
+name##_blocks(const uint32_t midstate[5], const uint32_t *words,             \
+        const int nblocks, uint32_t limit) {                                 \
+    typedef uint32_t vec __attribute__((vector_size(4 * (lanes))));          \
+    vec H[5];                                                                \
+    vec W[16];                                                               \
+    vec A, B, C, D, E;                                                       \
+    int b, t, j;                                                             \
+    for (t = 0; t < 5; t++)                                                  \
+        H[t] = (vec) {} + midstate[t];                                       \
+    for (b = 0; b < nblocks; b++) {                                          \
+        for (t = 0; t < 16; t++)                                             \
+            memcpy(&W[t], words + (b * 16 + t) * (lanes), sizeof(vec));      \
+        A = H[0];                                                            \
+        B = H[1];                                                            \
+        C = H[2];                                                            \
+        D = H[3];                                                            \
+        E = H[4];                                                            \
+        SHA1Round20(SHA1Ch,     0x5A827999, 0);                              \
+        SHA1Round20(SHA1Parity, 0x6ED9EBA1, 20);                             \
+        SHA1Round20(SHA1Maj,    0x8F1BBCDC, 40);                             \
+        SHA1Round20(SHA1Parity, 0xCA62C1D6, 60);                             \
+        H[0] += A;                                                           \
+        if (b + 1 == nblocks)                                                \
+            break;  /* only the front word is tested */                      \
+        H[1] += B;                                                           \
+        H[2] += C;                                                           \
+        H[3] += D;                                                           \
+        H[4] += E;                                                           \
+    }                                                                        \
+    vec hit = (vec) (H[0] <= limit);                                         \
+    uint32_t bits = 0;                                                       \
+    for (j = 0; j < (lanes); j++)                                            \
+        if (hit[j])                                                          \
+            bits |= 1u << j;                                                 \
+    return bits;                                                             \
+}                                                                            \
+attr uint32_t name(const uint32_t midstate[5], const uint32_t *words,        \
+        int nblocks, uint32_t limit) {                                       \
+    if (nblocks == 1)                                                        \
+        return name##_blocks(midstate, words, 1, limit);                     \
+    return name##_blocks(midstate, words, 2, limit);                         \
+}                                                                            \
+static inline __attribute__((always_inline)) attr uint32_t                   \
+name##_from_blocks(const struct scan_prefix *prefix, const uint32_t *words,  \
+        const int nblocks, uint32_t limit) {                                 \
+    typedef uint32_t vec __attribute__((vector_size(4 * (lanes))));          \
+    vec H[5];                                                                \
+    vec S[5];                                                                \
+    vec W[16];                                                               \
+    vec A, B, C, D, E;                                                       \
+    int b, t, j;                                                             \
+    for (t = 0; t < 5; t++) {                                                \
+        H[t] = (vec) {} + prefix->chain[t];                                  \
+        S[t] = (vec) {} + prefix->state[t];                                  \
+    }                                                                        \
+    for (b = prefix->block; b < nblocks; b++) {                              \
+        for (t = 0; t < 16; t++)                                             \
+            memcpy(&W[t], words + (b * 16 + t) * (lanes), sizeof(vec));      \
+        int from = b == prefix->block ? prefix->round : 0;                   \
+        if (b == prefix->block) {                                            \
+            SHA1Enter(from, S);                                              \
+        } else {                                                             \
+            SHA1Enter(0, H);                                                 \
+        }                                                                    \
+        SHA1Round20From(from);                                               \
+        SHA1Round20(SHA1Parity, 0x6ED9EBA1, 20);                             \
+        SHA1Round20(SHA1Maj,    0x8F1BBCDC, 40);                             \
+        SHA1Round20(SHA1Parity, 0xCA62C1D6, 60);                             \
+        H[0] += A;                                                           \
+        if (b + 1 == nblocks)                                                \
+            break;                                                           \
+        H[1] += B;                                                           \
+        H[2] += C;                                                           \
+        H[3] += D;                                                           \
+        H[4] += E;                                                           \
+    }                                                                        \
+    vec hit = (vec) (H[0] <= limit);                                         \
+    uint32_t bits = 0;                                                       \
+    for (j = 0; j < (lanes); j++)                                            \
+        if (hit[j])                                                          \
+            bits |= 1u << j;                                                 \
+    return bits;                                                             \
+}                                                                            \
+attr uint32_t name##_from(const struct scan_prefix *prefix,                  \
+        const uint32_t *words, uint32_t limit) {                             \
+    if (prefix->nblocks == 1)                                                \
+        return name##_from_blocks(prefix, words, 1, limit);                  \
+    return name##_from_blocks(prefix, words, 2, limit);                      \
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+SHA1_LANES_KERNEL(sha1_x4_sse2, __attribute__((target("sse2"))), 4)
+SHA1_LANES_KERNEL(sha1_x8_avx2, __attribute__((target("avx2"))), 8)
+SHA1_LANES_KERNEL(sha1_x16_avx512, __attribute__((target("avx512f"))), 16)
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+SHA1_LANES_KERNEL(sha1_x4_neon, , 4)
+#endif
+
+/* Calibration takes this many samples of each kernel, in turn, after one
+ * sample each to warm up */
+#define SHA1_CALIBRATION_SAMPLES 5
+#define SHA1_CALIBRATION_SECONDS 0.001
+
+/* Function: sha1_kernel_rate
+ * --------------------------
+ * Measures roughly how many single-block hashes per second a kernel does,
+ * by running it on dummy data for SHA1_CALIBRATION_SECONDS.
+ */
+double sha1_kernel_rate(const struct sha1_kernel *kernel) {
+    uint32_t words[16 * SHA1_MAX_LANES] = { 0 };
+    uint32_t state[5] = { 0 };
+    struct timespec start, now;
+    uint64_t hashes = 0;
+    double elapsed;
+    volatile uint32_t sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        int i;
+        for (i = 0; i < 256; i++) {
+            if (kernel->scan != NULL) {
+                sink += kernel->scan(state, words, 1, sink);
+            } else {
+                sink += kernel->front(state, words);
+            }
+            words[0]++;
+        }
+        hashes += 256 * kernel->lanes;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while (elapsed < SHA1_CALIBRATION_SECONDS);
+
+    sink += state[0];
+    return hashes / elapsed;
+}
+
+/* Function: sha1_faster
+ * ---------------------
+ * Compares two kernels by the best of several samples of each, taken
+ * alternately, so that a preemption or the vector unit waking up only
+ * spoils a sample rather than the comparison.
+ *
+ * returns: true if a is faster than b
+ */
+static bool sha1_faster(const struct sha1_kernel *a, const struct sha1_kernel *b) {
+    double best_a = 0, best_b = 0;
+    int s;
+    for (s = 0; s <= SHA1_CALIBRATION_SAMPLES; s++) {
+        double rate_a, rate_b;
+        if (s % 2 == 0) {
+            rate_a = sha1_kernel_rate(a);
+            rate_b = sha1_kernel_rate(b);
+        } else {
+            rate_b = sha1_kernel_rate(b);
+            rate_a = sha1_kernel_rate(a);
+        }
+        if (s == 0)
+            continue;  /* warm-up */
+        if (rate_a > best_a)
+            best_a = rate_a;
+        if (rate_b > best_b)
+            best_b = rate_b;
+    }
+    return best_a > best_b;
+}
+
+/* Function: sha1_select_kernel
+ * ----------------------------
+ * Picks a backend supported by the running CPU. By default that is the
+ * fastest: the widest multi-buffer kernel, or the hardware SHA-1
+ * instructions if present and faster. The portable scalar kernel is the
+ * fallback.
+ *
+ * name: "portable", a multi-buffer kernel ("sse2", "avx2", "avx512",
+ *       "neon") or SHA1_HW_NAME to use that one; NULL or "auto" for the
+ *       fastest
+ * kernel: receives the kernel to use; lanes is 1 and scan is NULL when
+ *         hashing one message at a time
+ *
+ * returns: 0, or -1 if the named kernel doesn't exist or this CPU can't
+ *          run it
+ */
+int sha1_select_kernel(const char *name, struct sha1_kernel *kernel) {
+    struct sha1_kernel portable = { "portable", 1, NULL, NULL, SHA1CompressWords,
+        SHA1CompressFront };
+    struct sha1_kernel vector[3];
+    int num_vector = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        vector[num_vector++] = (struct sha1_kernel) { "sse2", 4, sha1_x4_sse2,
+            sha1_x4_sse2_from, SHA1CompressWords, SHA1CompressFront };
+    if (__builtin_cpu_supports("avx2"))
+        vector[num_vector++] = (struct sha1_kernel) { "avx2", 8, sha1_x8_avx2,
+            sha1_x8_avx2_from, SHA1CompressWords, SHA1CompressFront };
+    if (__builtin_cpu_supports("avx512f"))
+        vector[num_vector++] = (struct sha1_kernel) { "avx512", 16, sha1_x16_avx512,
+            sha1_x16_avx512_from, SHA1CompressWords, SHA1CompressFront };
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    vector[num_vector++] = (struct sha1_kernel) { "neon", 4, sha1_x4_neon,
+        sha1_x4_neon_from, SHA1CompressWords, SHA1CompressFront };
+#endif
+
+    bool have_hw = SHA1_HW_NAME != NULL && sha1_hw_available();
+    struct sha1_kernel hw = { SHA1_HW_NAME, 1, NULL, NULL, sha1_compress_hw,
+        sha1_front_hw };
+    bool automatic = name == NULL || strcmp(name, "auto") == 0;
+
+    if (!automatic && strcmp(name, "portable") == 0) {
+        *kernel = portable;
+        return 0;
+    }
+    if (!automatic && have_hw && strcmp(name, SHA1_HW_NAME) == 0) {
+        *kernel = hw;
+        return 0;
+    }
+
+    int v = num_vector - 1;  /* the widest */
+    if (!automatic) {
+        for (v = 0; v < num_vector && strcmp(name, vector[v].name) != 0; v++)
+            ;
+        if (v == num_vector)
+            return -1;
+    }
+    if (v < 0) {
+        *kernel = have_hw ? hw : portable;
+        return 0;
+    }
+
+    *kernel = vector[v];
+    if (have_hw) {
+        if (automatic && sha1_faster(&hw, kernel)) {
+            *kernel = hw;
+            return 0;
+        }
+        /* Still use the hardware for the occasional one-off block */
+        kernel->compress = sha1_compress_hw;
+        kernel->front = sha1_front_hw;
+    }
+    return 0;
+}
+
+/* Function: sha1_scan_prefix
+ * --------------------------
+ * Does the work a scan would otherwise repeat in every lane when its tails
+ * only differ from word first_word on: whole blocks before that word are
+ * compressed, and so are the rounds of its block that only read words in
+ * front of it.
+ *
+ * prefix: filled in for the kernels' _from entry points
+ * midstate: state before the tail
+ * words: any one of the tails, laid out as build_tail() does
+ * nblocks: tail blocks
+ * first_word: index of the first tail word that varies
+ */
+void sha1_scan_prefix(struct scan_prefix *prefix, const uint32_t midstate[5],
+        const uint32_t *words, int nblocks, int first_word) {
+    memcpy(prefix->chain, midstate, sizeof(uint32_t) * 5);
+    prefix->nblocks = nblocks;
+    prefix->block = first_word / 16;
+    prefix->round = first_word % 16;
+
+    int t;
+    for (t = 0; t < prefix->block; t++)
+        SHA1CompressWords(prefix->chain, words + 16 * t);
+
+    const uint32_t *W = words + 16 * prefix->block;
+    uint32_t a = prefix->chain[0], b = prefix->chain[1], c = prefix->chain[2],
+        d = prefix->chain[3], e = prefix->chain[4];
+    for (t = 0; t < prefix->round; t++) {
+        uint32_t temp = SHA1CircularShift(5, a) + SHA1Ch(b, c, d) + e
+            + 0x5A827999 + W[t];
+        e = d;
+        d = c;
+        c = SHA1CircularShift(30, b);
+        b = a;
+        a = temp;
+    }
+    prefix->state[0] = a;
+    prefix->state[1] = b;
+    prefix->state[2] = c;
+    prefix->state[3] = d;
+    prefix->state[4] = e;
+}
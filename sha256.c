@@ -0,0 +1,278 @@
+/**
+ * sha256.c
+ *
+ * SHA-256 and double SHA-256 (SHA-256d, as used by Bitcoin): the portable
+ * compression function, midstates and a one-shot reference hash, plus
+ * multi-buffer SHA-256d kernels written with GCC vector extensions in the
+ * same way as the SHA-1 ones in sha1_simd.c.
+ *
+ * Like Bitcoin, SHA-256d results are handled in display order: the digest
+ * bytes reversed, so leading zeros of the displayed hash are what the
+ * difficulty counts. Word 0 of a result is therefore the byte-swapped last
+ * word of the second hash's state.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+static const uint32_t SHA256K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+    0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+    0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+    0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+    0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+    0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const uint32_t SHA256IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+void SHA256CompressWords(uint32_t state[8], const uint32_t Words[16]);
+size_t sha256midstate(uint32_t state[8], const char *data, size_t len);
+void sha256d_tail(const uint32_t midstate[8], const uint32_t *words,
+        int nblocks, uint32_t hash[8]);
+uint32_t sha256d_front(const uint32_t midstate[8], const uint32_t *words,
+        int nblocks);
+void sha256d_digest(uint32_t hash[8], const char *message, size_t len);
+
+/* Round functions. They work on scalars and on GCC vectors alike, so the
+ * same rounds serve the portable and the multi-buffer code. */
+#define SHA256Rotr(n,x)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256Ch(e,f,g)   (((e) & (f)) ^ (~(e) & (g)))
+#define SHA256Maj(a,b,c)  (((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)))
+#define SHA256Sigma0(a)   (SHA256Rotr(2,a) ^ SHA256Rotr(13,a) ^ SHA256Rotr(22,a))
+#define SHA256Sigma1(e)   (SHA256Rotr(6,e) ^ SHA256Rotr(11,e) ^ SHA256Rotr(25,e))
+#define SHA256sigma0(x)   (SHA256Rotr(7,x) ^ SHA256Rotr(18,x) ^ ((x) >> 3))
+#define SHA256sigma1(x)   (SHA256Rotr(17,x) ^ SHA256Rotr(19,x) ^ ((x) >> 10))
+
+/* The message schedule is kept in a rolling 16-word window, as in sha1.c */
+#define SHA256Schedule(t) ((t) < 16 ? W[(t) & 15] : \
+        (W[(t) & 15] += SHA256sigma1(W[((t) - 2) & 15]) + W[((t) - 7) & 15] \
+            + SHA256sigma0(W[((t) - 15) & 15])))
+
+/* All 64 rounds on working variables a-h and window W, with T1, T2 and t
+ * declared by the caller */
+#define SHA256Rounds()                                                       \
+    for (t = 0; t < 64; t++) {                                               \
+        T1 = h + SHA256Sigma1(e) + SHA256Ch(e, f, g) + SHA256K[t]            \
+            + SHA256Schedule(t);                                             \
+        T2 = SHA256Sigma0(a) + SHA256Maj(a, b, c);                           \
+        h = g;                                                               \
+        g = f;                                                               \
+        f = e;                                                               \
+        e = d + T1;                                                          \
+        d = c;                                                               \
+        c = b;                                                               \
+        b = a;                                                               \
+        a = T1 + T2;                                                         \
+    }
+
+/* Function: SHA256CompressWords
+ * -----------------------------
+ * Runs the 64 rounds over one block of big-endian 32-bit words.
+ *
+ * state: chaining state, updated in place
+ * Words: the 16 message words of the block
+ */
+void SHA256CompressWords(uint32_t state[8], const uint32_t Words[16]) {
+    uint32_t W[16];
+    uint32_t a, b, c, d, e, f, g, h, T1, T2;
+    int t;
+    memcpy(W, Words, sizeof(W));
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+    SHA256Rounds();
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/* Loads 64 bytes as big-endian words */
+static void sha256_load_block(uint32_t words[16], const uint8_t *bytes) {
+    int t;
+    for (t = 0; t < 16; t++) {
+        words[t] = (uint32_t) bytes[4 * t] << 24 | bytes[4 * t + 1] << 16
+            | bytes[4 * t + 2] << 8 | bytes[4 * t + 3];
+    }
+}
+
+/* Block holding a 32-byte first hash, padded for hashing again */
+static void sha256_digest_block(uint32_t words[16], const uint32_t digest[8]) {
+    memcpy(words, digest, sizeof(uint32_t) * 8);
+    words[8] = 0x80000000;
+    memset(words + 9, 0, sizeof(uint32_t) * 6);
+    words[15] = 256;
+}
+
+/* Turns the second hash's state into display-order words */
+static void sha256d_display(uint32_t hash[8], const uint32_t state[8]) {
+    int i;
+    for (i = 0; i < 8; i++)
+        hash[i] = __builtin_bswap32(state[7 - i]);
+}
+
+/* Function: sha256midstate
+ * ------------------------
+ * Absorbs every full 64-byte block of data, like sha1midstate().
+ *
+ * returns: number of bytes absorbed (a multiple of 64)
+ */
+size_t sha256midstate(uint32_t state[8], const char *data, size_t len) {
+    size_t absorbed = len - (len % 64);
+    memcpy(state, SHA256IV, sizeof(SHA256IV));
+
+    uint32_t words[16];
+    size_t i;
+    for (i = 0; i < absorbed; i += 64) {
+        sha256_load_block(words, (const uint8_t *) data + i);
+        SHA256CompressWords(state, words);
+    }
+    return absorbed;
+}
+
+/* Function: sha256d_tail
+ * ----------------------
+ * Finishes a SHA-256d hash from a midstate and the padded tail blocks.
+ *
+ * hash: receives the result in display order
+ */
+void sha256d_tail(const uint32_t midstate[8], const uint32_t *words,
+        int nblocks, uint32_t hash[8]) {
+    uint32_t state[8], block[16];
+    memcpy(state, midstate, sizeof(state));
+    int b;
+    for (b = 0; b < nblocks; b++)
+        SHA256CompressWords(state, words + 16 * b);
+
+    sha256_digest_block(block, state);
+    memcpy(state, SHA256IV, sizeof(state));
+    SHA256CompressWords(state, block);
+    sha256d_display(hash, state);
+}
+
+/* Function: sha256d_front
+ * -----------------------
+ * Like sha256d_tail, but only returns word 0 of the result.
+ */
+uint32_t sha256d_front(const uint32_t midstate[8], const uint32_t *words,
+        int nblocks) {
+    uint32_t hash[8];
+    sha256d_tail(midstate, words, nblocks, hash);
+    return hash[0];
+}
+
+/* Function: sha256d_digest
+ * ------------------------
+ * Reference SHA-256d of a whole message, for checking solutions.
+ *
+ * hash: receives the result in display order
+ */
+void sha256d_digest(uint32_t hash[8], const char *message, size_t len) {
+    uint32_t state[8], words[32];
+    size_t absorbed = sha256midstate(state, message, len);
+
+    uint8_t tail[128] = { 0 };
+    size_t left = len - absorbed;
+    memcpy(tail, message + absorbed, left);
+    tail[left] = 0x80;
+    int nblocks = left > 55 ? 2 : 1;
+    uint64_t bits = (uint64_t) len * 8;
+    int i;
+    for (i = 0; i < 8; i++)
+        tail[64 * nblocks - 1 - i] = bits >> (8 * i);
+
+    sha256_load_block(words, tail);
+    sha256_load_block(words + 16, tail + 64);
+    sha256d_tail(state, words, nblocks, hash);
+}
+
+/* Defines a SHA-256d kernel with the same interface as the SHA-1 ones: it
+ * hashes `lanes` tails from a shared midstate and returns a bitmask of the
+ * lanes whose (display-order) word 0 is at most limit. Only state word 7 of
+ * the second hash is needed for that. As with SHA1_LANES_KERNEL, the body
+ * is expanded separately for one- and two-block tails. */
+#define SHA256D_LANES_KERNEL(name, attr, lanes)                              \
+static inline __attribute__((always_inline)) attr uint32_t                   \
+name##_blocks(const uint32_t midstate[8], const uint32_t *words,             \
+        const int nblocks, uint32_t limit) {                                 \
+    typedef uint32_t vec __attribute__((vector_size(4 * (lanes))));          \
+    vec H[8];                                                                \
+    vec W[16];                                                               \
+    vec a, b, c, d, e, f, g, h, T1, T2;                                      \
+    int blk, t, j;                                                           \
+    for (t = 0; t < 8; t++)                                                  \
+        H[t] = (vec) {} + midstate[t];                                       \
+    for (blk = 0; blk < nblocks; blk++) {                                    \
+        for (t = 0; t < 16; t++)                                             \
+            memcpy(&W[t], words + (blk * 16 + t) * (lanes), sizeof(vec));    \
+        a = H[0];                                                            \
+        b = H[1];                                                            \
+        c = H[2];                                                            \
+        d = H[3];                                                            \
+        e = H[4];                                                            \
+        f = H[5];                                                            \
+        g = H[6];                                                            \
+        h = H[7];                                                            \
+        SHA256Rounds();                                                      \
+        H[0] += a;                                                           \
+        H[1] += b;                                                           \
+        H[2] += c;                                                           \
+        H[3] += d;                                                           \
+        H[4] += e;                                                           \
+        H[5] += f;                                                           \
+        H[6] += g;                                                           \
+        H[7] += h;                                                           \
+    }                                                                        \
+    for (t = 0; t < 8; t++)                                                  \
+        W[t] = H[t];                                                         \
+    W[8] = (vec) {} + 0x80000000;                                            \
+    for (t = 9; t < 15; t++)                                                 \
+        W[t] = (vec) {};                                                     \
+    W[15] = (vec) {} + 256;                                                  \
+    a = (vec) {} + SHA256IV[0];                                              \
+    b = (vec) {} + SHA256IV[1];                                              \
+    c = (vec) {} + SHA256IV[2];                                              \
+    d = (vec) {} + SHA256IV[3];                                              \
+    e = (vec) {} + SHA256IV[4];                                              \
+    f = (vec) {} + SHA256IV[5];                                              \
+    g = (vec) {} + SHA256IV[6];                                              \
+    h = (vec) {} + SHA256IV[7];                                              \
+    SHA256Rounds();                                                          \
+    uint32_t bits = 0;                                                       \
+    for (j = 0; j < (lanes); j++)                                            \
+        if (__builtin_bswap32(h[j] + SHA256IV[7]) <= limit)                  \
+            bits |= 1u << j;                                                 \
+    return bits;                                                             \
+}                                                                            \
+attr uint32_t name(const uint32_t midstate[8], const uint32_t *words,        \
+        int nblocks, uint32_t limit) {                                       \
+    if (nblocks == 1)                                                        \
+        return name##_blocks(midstate, words, 1, limit);                     \
+    return name##_blocks(midstate, words, 2, limit);                         \
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+SHA256D_LANES_KERNEL(sha256d_x4_sse2, __attribute__((target("sse2"))), 4)
+SHA256D_LANES_KERNEL(sha256d_x8_avx2, __attribute__((target("avx2"))), 8)
+SHA256D_LANES_KERNEL(sha256d_x16_avx512, __attribute__((target("avx512f"))), 16)
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+SHA256D_LANES_KERNEL(sha256d_x4_neon, , 4)
+#endif
@@ -0,0 +1,231 @@
+/**
+ * task_ring.c
+ *
+ * The queue scheduler's tasks: a bounded multi-producer, multi-consumer
+ * ring of nonce ranges, after Dmitry Vyukov's bounded MPMC queue. Every
+ * cell carries a sequence number that says whether it is free for the
+ * enqueue position that maps onto it or holds the task for the matching
+ * dequeue position, so a producer or consumer claims a position with one
+ * compare-and-swap and nobody takes a lock. Producers can run up to
+ * TASK_RING_SIZE tasks ahead, and a consumer takes up to TASK_BATCH
+ * consecutive tasks with a single claim.
+ *
+ * Only a consumer that finds the ring empty, or a producer that finds it
+ * full, goes to sleep, on a futex; the other side only makes the wake-up
+ * system call when it has seen that somebody is asleep.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define TASK_RING_SIZE 256  /* a power of two */
+#define TASK_BATCH 4
+
+/* Nonces [start, start + count) */
+struct task {
+    uint64_t start;
+    uint32_t count;
+};
+
+struct task_cell {
+    _Atomic size_t sequence;
+    struct task task;
+};
+
+/* Each side's position and futex word sit on cache lines of their own */
+struct task_ring {
+    __attribute__((aligned(64))) _Atomic size_t enqueue_pos;
+    __attribute__((aligned(64))) _Atomic size_t dequeue_pos;
+
+    /* Bumped to wake consumers once there are tasks, and producers once
+     * there is room, and how many of each are asleep */
+    __attribute__((aligned(64))) _Atomic uint32_t posted;
+    _Atomic uint32_t consumers_asleep;
+    __attribute__((aligned(64))) _Atomic uint32_t freed;
+    _Atomic uint32_t producers_asleep;
+
+    __attribute__((aligned(64))) struct task_cell cells[TASK_RING_SIZE];
+};
+
+void task_ring_init(struct task_ring *ring);
+bool task_ring_push(struct task_ring *ring, uint64_t start, uint32_t count);
+int task_ring_pop(struct task_ring *ring, struct task tasks[], int max);
+void task_ring_park(struct task_ring *ring, bool consumer, bool (*done)(void *),
+        void *arg);
+void task_ring_wake_all(struct task_ring *ring);
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t seen) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Function: task_ring_init
+ * ------------------------
+ * Empties a ring. Nobody may be using it at the time.
+ */
+void task_ring_init(struct task_ring *ring) {
+    size_t i;
+    for (i = 0; i < TASK_RING_SIZE; i++)
+        atomic_store_explicit(&ring->cells[i].sequence, i, memory_order_relaxed);
+    atomic_store(&ring->enqueue_pos, 0);
+    atomic_store(&ring->dequeue_pos, 0);
+}
+
+/* Function: task_ring_push
+ * ------------------------
+ * Adds a task, waking a sleeping consumer if there is one.
+ *
+ * returns: false if the ring is full
+ */
+bool task_ring_push(struct task_ring *ring, uint64_t start, uint32_t count) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    struct task_cell *cell;
+    for (;;) {
+        cell = &ring->cells[pos & (TASK_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;  /* the cell still holds a task from a lap ago */
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->task.start = start;
+    cell->task.count = count;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+    /* Pairs with the fence in task_ring_park(): either the sleeper sees
+     * this task, or this sees the sleeper */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->consumers_asleep, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&ring->posted, 1);
+        futex_wake(&ring->posted, 1);
+    }
+    return true;
+}
+
+/* Function: task_ring_pop
+ * -----------------------
+ * Takes up to max tasks (at most TASK_BATCH) that are ready in a row, and
+ * wakes a sleeping producer if there is one.
+ *
+ * tasks: receives the tasks, oldest first
+ *
+ * returns: how many were taken, 0 if the ring is empty
+ */
+int task_ring_pop(struct task_ring *ring, struct task tasks[], int max) {
+    if (max > TASK_BATCH)
+        max = TASK_BATCH;
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    int n;
+    for (;;) {
+        /* Count the ready cells from pos on; a producer that claimed an
+         * earlier position may still be filling its cell, so stop at the
+         * first that isn't */
+        for (n = 0; n < max; n++) {
+            struct task_cell *cell = &ring->cells[(pos + n) & (TASK_RING_SIZE - 1)];
+            size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+            if (sequence != pos + n + 1)
+                break;
+        }
+        if (n == 0) {
+            struct task_cell *cell = &ring->cells[pos & (TASK_RING_SIZE - 1)];
+            size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+            if ((intptr_t) sequence - (intptr_t) (pos + 1) < 0)
+                return 0;  /* empty */
+            /* Another consumer got there first */
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + n,
+                    memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+
+    int i;
+    for (i = 0; i < n; i++) {
+        struct task_cell *cell = &ring->cells[(pos + i) & (TASK_RING_SIZE - 1)];
+        tasks[i] = cell->task;
+        atomic_store_explicit(&cell->sequence, pos + i + TASK_RING_SIZE,
+                memory_order_release);
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->producers_asleep, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&ring->freed, 1);
+        futex_wake(&ring->freed, 1);
+    }
+    return n;
+}
+
+/* Function: task_ring_empty
+ * -------------------------
+ * returns: true if the next cell to dequeue has no task in it
+ */
+static bool task_ring_empty(struct task_ring *ring) {
+    size_t pos = atomic_load(&ring->dequeue_pos);
+    struct task_cell *cell = &ring->cells[pos & (TASK_RING_SIZE - 1)];
+    return atomic_load(&cell->sequence) != pos + 1;
+}
+
+/* Function: task_ring_full
+ * ------------------------
+ * returns: true if the next cell to enqueue still holds a task
+ */
+static bool task_ring_full(struct task_ring *ring) {
+    size_t pos = atomic_load(&ring->enqueue_pos);
+    struct task_cell *cell = &ring->cells[pos & (TASK_RING_SIZE - 1)];
+    return atomic_load(&cell->sequence) != pos;
+}
+
+/* Function: task_ring_park
+ * ------------------------
+ * Sleeps until the ring has a task (for a consumer) or room for one (for a
+ * producer), or until woken by task_ring_wake_all(). May return early, so
+ * callers try again in a loop.
+ *
+ * done: checked after the thread has announced it is going to sleep, so
+ *       a condition set before calling task_ring_wake_all() is never missed;
+ *       the thread doesn't sleep if it returns true
+ */
+void task_ring_park(struct task_ring *ring, bool consumer, bool (*done)(void *),
+        void *arg) {
+    _Atomic uint32_t *word = consumer ? &ring->posted : &ring->freed;
+    _Atomic uint32_t *asleep = consumer ? &ring->consumers_asleep
+        : &ring->producers_asleep;
+
+    uint32_t seen = atomic_load(word);
+    atomic_fetch_add(asleep, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!done(arg) && (consumer ? task_ring_empty(ring) : task_ring_full(ring)))
+        futex_wait(word, seen);
+    atomic_fetch_sub(asleep, 1);
+}
+
+/* Function: task_ring_wake_all
+ * ----------------------------
+ * Wakes every thread parked on the ring, so it can check whatever the
+ * caller changed before this.
+ */
+void task_ring_wake_all(struct task_ring *ring) {
+    atomic_thread_fence(memory_order_seq_cst);
+    atomic_fetch_add(&ring->posted, 1);
+    atomic_fetch_add(&ring->freed, 1);
+    futex_wake(&ring->posted, INT_MAX);
+    futex_wake(&ring->freed, INT_MAX);
+}